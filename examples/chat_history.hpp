@@ -0,0 +1,98 @@
+#ifndef CHAT_HISTORY_HPP
+#define CHAT_HISTORY_HPP
+
+#include <string>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+
+#include "chat_message.hpp"
+
+namespace chat{
+
+// Bounded history of the chat room.
+//
+// Keeps the last `capacity` messages in serialized form: a ring of
+// entry sizes over one contiguous byte string. A joining client gets
+// the "inv:N:" header followed by those bytes as they are, so a join
+// costs one copy of the live entries however often the room changes.
+class History{
+
+    std::size_t capacity_;
+
+    // ring of serialized entry sizes
+    std::vector<std::size_t> sizes_;
+    std::size_t first_ = 0;
+    std::size_t count_ = 0;
+
+    // serialized entries, live bytes are body_[head_, body_.size())
+    std::string body_;
+    std::size_t head_ = 0;
+
+    void evict(){
+        head_ += sizes_[first_];
+        first_ = (first_ + 1) % capacity_;
+        --count_;
+
+        // amortized compaction: at most one memmove of the live bytes
+        // per `capacity` evictions
+        if(head_ > body_.size() / 2){
+            body_.erase(0, head_);
+            head_ = 0;
+        }
+    }
+
+public:
+
+    explicit History(std::size_t capacity)
+        : capacity_{capacity > 0 ? capacity : 1},
+          sizes_(capacity_)
+    {}
+
+    std::size_t size() const{
+        return count_;
+    }
+
+    std::size_t capacity() const{
+        return capacity_;
+    }
+
+    void push(const Message & message){
+        if(count_ == capacity_)
+            evict();
+
+        sizes_[(first_ + count_) % capacity_] = message.serialize(body_);
+        ++count_;
+    }
+
+    // Appends an entry that is already in the serialized message format
+    // (e.g. replayed from chat::Log), without parsing it.
+    void push_serialized(const char* data, std::size_t size){
+        if(count_ == capacity_)
+            evict();
+
+        body_.append(data, size);
+        sizes_[(first_ + count_) % capacity_] = size;
+        ++count_;
+    }
+
+    // Writes the serialized history ("inv:N:" followed by the last N
+    // messages) to a DynamicBuffer: the header, then the live entries
+    // straight from the ring.
+    template<class DynamicBuffer>
+    void write(DynamicBuffer & out) const{
+        std::string header;
+        Inv{static_cast<uint32_t>(count_)}.serialize(header);
+        out.commit(boost::asio::buffer_copy(out.prepare(header.size()),
+                                            boost::asio::buffer(header)));
+
+        auto const live = body_.size() - head_;
+        out.commit(boost::asio::buffer_copy(out.prepare(live),
+                                            boost::asio::buffer(body_.data() + head_, live)));
+    }
+
+}; // History class
+
+} // namespace chat
+
+#endif // CHAT_HISTORY_HPP
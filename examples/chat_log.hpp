@@ -0,0 +1,341 @@
+#ifndef CHAT_LOG_HPP
+#define CHAT_LOG_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/system/error_code.hpp>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chat_message.hpp"
+#include "chat_history.hpp"
+
+namespace chat{
+
+// Append-only persistent chat log (POSIX).
+//
+// The log is a directory of segments:
+//          "<dir>/<id>.log" - serialized messages back to back
+//          "<dir>/<id>.idx" - uint64_t end offset of every record in .log
+// Records are written in the chat message format, so replaying them
+// needs no parsing. Appends only copy into a pending batch; a writer
+// thread writes and fdatasync()s batches off the I/O threads, and starts
+// a new segment once the current one is larger than `segment_size`.
+class Log{
+
+public:
+
+    using error_handler_t = std::function<void(const boost::system::error_code&)>;
+
+private:
+
+    // Read-only mapping of a whole file
+    class mapped_file{
+
+        void* data_ = MAP_FAILED;
+        std::size_t size_ = 0;
+
+    public:
+
+        explicit mapped_file(const std::string & path){
+            int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0)
+                return;
+
+            struct stat st;
+            if(::fstat(fd, &st) == 0 && st.st_size > 0){
+                size_ = static_cast<std::size_t>(st.st_size);
+                data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(data_ == MAP_FAILED)
+                    size_ = 0;
+            }
+
+            ::close(fd);
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        ~mapped_file(){
+            if(data_ != MAP_FAILED)
+                ::munmap(data_, size_);
+        }
+
+        const char* data() const{
+            return static_cast<const char*>(data_);
+        }
+
+        std::size_t size() const{
+            return size_;
+        }
+
+    }; // mapped_file class
+
+    // Number of leading records of a segment that are complete on disk
+    static std::size_t valid_records(const mapped_file & idx, const mapped_file & log){
+        auto const ends = reinterpret_cast<const uint64_t*>(idx.data());
+        std::size_t count = idx.size() / sizeof(uint64_t);
+
+        while(count > 0 && ends[count - 1] > log.size())
+            --count;
+
+        return count;
+    }
+
+    std::string dir_;
+    std::size_t segment_size_;
+    std::chrono::milliseconds flush_interval_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::string pending_;
+    std::vector<uint64_t> pending_sizes_;
+
+    // writer thread state
+    uint64_t segment_id_ = 0;
+    uint64_t segment_bytes_ = 0;
+    int log_fd_ = -1;
+    int idx_fd_ = -1;
+    std::thread writer_;
+
+    // set before the writer starts, called from it
+    const error_handler_t on_error_;
+
+    std::string path(uint64_t id, const char* ext) const{
+        char name[32];
+        std::snprintf(name, sizeof(name), "/%016llx.%s", static_cast<unsigned long long>(id), ext);
+        return dir_ + name;
+    }
+
+    std::vector<uint64_t> segments() const{
+        std::vector<uint64_t> ids;
+
+        DIR* d = ::opendir(dir_.c_str());
+        if(d == nullptr)
+            return ids;
+
+        while(auto const entry = ::readdir(d)){
+            std::string const name = entry->d_name;
+            if(name.size() != 20 || name.compare(16, 4, ".log") != 0)
+                continue;
+            // not a segment this log wrote
+            if(!std::all_of(name.begin(), name.begin() + 16,
+                            [](char c){ return std::isxdigit(static_cast<unsigned char>(c)) != 0; }))
+                continue;
+            ids.push_back(std::stoull(name.substr(0, 16), nullptr, 16));
+        }
+
+        ::closedir(d);
+
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    void fail(){
+        boost::system::error_code const ec{errno, boost::system::system_category()};
+        if(on_error_)
+            on_error_(ec);
+    }
+
+    void open_segment(uint64_t id){
+        if(log_fd_ >= 0)
+            ::close(log_fd_);
+        if(idx_fd_ >= 0)
+            ::close(idx_fd_);
+
+        segment_id_ = id;
+        segment_bytes_ = 0;
+
+        log_fd_ = ::open(path(id, "log").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        idx_fd_ = ::open(path(id, "idx").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+        if(log_fd_ < 0 || idx_fd_ < 0)
+            return fail();
+
+        // Drop a torn tail left by a crash, keep the .log and .idx consistent
+        std::size_t count = 0;
+        {
+            mapped_file const idx{path(id, "idx")};
+            mapped_file const log{path(id, "log")};
+            count = valid_records(idx, log);
+            if(count > 0)
+                segment_bytes_ = reinterpret_cast<const uint64_t*>(idx.data())[count - 1];
+        }
+
+        if(::ftruncate(log_fd_, static_cast<off_t>(segment_bytes_)) != 0
+                || ::ftruncate(idx_fd_, static_cast<off_t>(count * sizeof(uint64_t))) != 0)
+            return fail();
+
+        ::lseek(log_fd_, 0, SEEK_END);
+        ::lseek(idx_fd_, 0, SEEK_END);
+    }
+
+    static bool write_all(int fd, const char* data, std::size_t size){
+        while(size > 0){
+            auto const n = ::write(fd, data, size);
+            if(n < 0){
+                if(errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += n;
+            size -= static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    void flush(const std::string & data, std::vector<uint64_t> & sizes){
+        if(log_fd_ < 0 || idx_fd_ < 0 || sizes.empty())
+            return;
+
+        // record sizes -> end offsets within the segment
+        for(auto & size : sizes){
+            segment_bytes_ += size;
+            size = segment_bytes_;
+        }
+
+        if(!write_all(log_fd_, data.data(), data.size())
+                || !write_all(idx_fd_, reinterpret_cast<const char*>(sizes.data()), sizes.size() * sizeof(uint64_t)))
+            return fail();
+
+        // data first, so a durable index entry never points past the data
+        if(::fdatasync(log_fd_) != 0 || ::fdatasync(idx_fd_) != 0)
+            return fail();
+
+        if(segment_bytes_ >= segment_size_)
+            open_segment(segment_id_ + 1);
+    }
+
+    void run(){
+        std::string data;
+        std::vector<uint64_t> sizes;
+
+        std::unique_lock<std::mutex> lock{mutex_};
+
+        for(;;){
+            cv_.wait_for(lock, flush_interval_, [this]{
+                return stop_ || pending_.size() >= segment_size_;
+            });
+
+            data.swap(pending_);
+            sizes.swap(pending_sizes_);
+            bool const stop = stop_;
+
+            lock.unlock();
+
+            flush(data, sizes);
+            data.clear();
+            sizes.clear();
+
+            if(stop)
+                return;
+
+            lock.lock();
+        }
+    }
+
+public:
+
+    // `on_error` gets the failures of the constructor and of the writer
+    // thread
+    explicit Log(const std::string & dir,
+                 error_handler_t on_error = {},
+                 std::size_t segment_size = 64 << 20,
+                 std::chrono::milliseconds flush_interval = std::chrono::milliseconds(50))
+        : dir_{dir},
+          segment_size_{segment_size},
+          flush_interval_{flush_interval},
+          on_error_{std::move(on_error)}
+    {
+        ::mkdir(dir_.c_str(), 0755);
+
+        auto const ids = segments();
+        open_segment(ids.empty() ? 0 : ids.back());
+
+        writer_ = std::thread{&Log::run, this};
+    }
+
+    Log(const Log&) = delete;
+    Log& operator=(const Log&) = delete;
+
+    ~Log(){
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stop_ = true;
+        }
+        cv_.notify_one();
+        writer_.join();
+
+        if(log_fd_ >= 0)
+            ::close(log_fd_);
+        if(idx_fd_ >= 0)
+            ::close(idx_fd_);
+    }
+
+    // Queue a message for the next batch. Cheap enough for I/O threads.
+    void append(const Message & message){
+        std::lock_guard<std::mutex> lock{mutex_};
+        pending_sizes_.push_back(message.serialize(pending_));
+    }
+
+    // Seed `history` with the newest stored messages. Walks back from the
+    // tail segment only as far as the history capacity needs and copies
+    // the records straight out of the mapped files, so restart time does
+    // not depend on the total number of stored messages.
+    // Call before the writer has anything queued (i.e. at startup).
+    void replay(History & history) const{
+        struct part{
+            std::unique_ptr<mapped_file> idx;
+            std::unique_ptr<mapped_file> log;
+            std::size_t first;
+            std::size_t last;
+        };
+
+        std::vector<part> parts;
+        std::size_t need = history.capacity();
+
+        auto const ids = segments();
+        for(auto it = ids.rbegin(); it != ids.rend() && need > 0; ++it){
+            part p{std::make_unique<mapped_file>(path(*it, "idx")),
+                   std::make_unique<mapped_file>(path(*it, "log")), 0, 0};
+
+            p.last = valid_records(*p.idx, *p.log);
+            auto const take = (std::min)(p.last, need);
+            p.first = p.last - take;
+            need -= take;
+
+            if(take > 0)
+                parts.push_back(std::move(p));
+        }
+
+        for(auto it = parts.rbegin(); it != parts.rend(); ++it){
+            auto const ends = reinterpret_cast<const uint64_t*>(it->idx->data());
+            for(auto i = it->first; i < it->last; ++i){
+                auto const begin = i == 0 ? 0 : ends[i - 1];
+                history.push_serialized(it->log->data() + begin,
+                                        static_cast<std::size_t>(ends[i] - begin));
+            }
+        }
+    }
+
+}; // Log class
+
+} // namespace chat
+
+#endif // CHAT_LOG_HPP
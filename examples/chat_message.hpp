@@ -3,6 +3,11 @@
 
 #include <string>
 #include <vector>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/asio/buffer.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/beast/core/multi_buffer.hpp>
 #include <boost/beast/core/buffers_to_string.hpp>
@@ -10,6 +15,79 @@
 
 namespace chat{
 
+namespace detail{
+
+inline std::size_t digits(std::size_t value){
+    std::size_t count = 1;
+    while(value >= 10){
+        value /= 10;
+        ++count;
+    }
+    return count;
+}
+
+/// \brief Sequential writer over a mutable buffer sequence
+/// (the result of DynamicBuffer::prepare()). The caller is
+/// responsible for preparing exactly as many bytes as it puts.
+template<class MutableBufferSequence>
+class buffer_writer{
+
+    using iterator = decltype(boost::asio::buffer_sequence_begin(
+                                  std::declval<const MutableBufferSequence&>()));
+
+    iterator it_;
+    iterator end_;
+    char* pos_ = nullptr;
+    std::size_t left_ = 0;
+
+    void next(){
+        boost::asio::mutable_buffer const b = *it_++;
+        pos_ = static_cast<char*>(b.data());
+        left_ = b.size();
+    }
+
+public:
+
+    explicit buffer_writer(const MutableBufferSequence & buffers)
+        : it_{boost::asio::buffer_sequence_begin(buffers)},
+          end_{boost::asio::buffer_sequence_end(buffers)}
+    {}
+
+    void put(const char* data, std::size_t size){
+        while(size > 0){
+            while(left_ == 0 && it_ != end_)
+                next();
+
+            if(left_ == 0)
+                throw std::length_error("buffer_writer overflow");
+
+            auto const n = (std::min)(size, left_);
+            std::memcpy(pos_, data, n);
+            pos_ += n;
+            left_ -= n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    void put(boost::beast::string_view s){
+        put(s.data(), s.size());
+    }
+
+    void put_number(std::size_t value){
+        char tmp[20];
+        char* first = tmp + sizeof(tmp);
+        do{
+            *--first = static_cast<char>('0' + value % 10);
+            value /= 10;
+        }while(value > 0);
+        put(first, static_cast<std::size_t>(tmp + sizeof(tmp) - first));
+    }
+
+}; // buffer_writer class
+
+} // namespace detail
+
 // chat protocol format
 //           "inv:3:'message'
 //                  'message'
@@ -34,7 +112,19 @@ struct Message{
     {}
 
     std::size_t get_serial_size() const{
-        return prefix_length + std::to_string(payload_.size()).size() + nickname_.size() + payload_.size() + 3;
+        return prefix_length + detail::digits(payload_.size()) + nickname_.size() + payload_.size() + 3;
+    }
+
+    template<class Writer>
+    std::size_t serialize_to(Writer & w) const{
+        w.put(prefix_string, prefix_length);
+        w.put(":", 1);
+        w.put_number(payload_.size());
+        w.put(":", 1);
+        w.put(nickname_);
+        w.put(":", 1);
+        w.put(payload_);
+        return get_serial_size();
     }
 
     auto serialize(std::string & out) const{
@@ -157,7 +247,16 @@ struct Inv{
     {}
 
     std::size_t get_serial_size() const{
-        return prefix_length + std::to_string(count_entry_).size() + 2;
+        return prefix_length + detail::digits(count_entry_) + 2;
+    }
+
+    template<class Writer>
+    std::size_t serialize_to(Writer & w) const{
+        w.put(prefix_string, prefix_length);
+        w.put(":", 1);
+        w.put_number(count_entry_);
+        w.put(":", 1);
+        return get_serial_size();
     }
 
     auto serialize(std::string & out) const{
@@ -300,6 +399,58 @@ public:
 
 }; // Serializer class
 
+template<class C, class T, class DynamicBuffer>
+class BufferSerializer;
+
+/// \brief Serializes messages straight into a DynamicBuffer
+/// (e.g. session::output()). The exact size is computed up front,
+/// so the whole batch costs one prepare() and one commit().
+template<class DynamicBuffer>
+class BufferSerializer<Inv, Message, DynamicBuffer>{
+
+    DynamicBuffer& out_;
+
+public:
+
+    BufferSerializer(DynamicBuffer & out)
+        : out_{out}
+    {}
+
+    template<class Iterator>
+    auto advance(Iterator first, Iterator last) const{
+        auto const count = static_cast<std::size_t>(std::distance(first, last));
+
+        if(count >= UINT32_MAX)
+            throw std::runtime_error("messages.size() >= UINT32_MAX");
+
+        auto const i = Inv{static_cast<uint32_t>(count)};
+
+        std::size_t used_bytes = i.get_serial_size();
+        for(auto it = first; it != last; ++it)
+            used_bytes += it->get_serial_size();
+
+        auto const buffers = out_.prepare(used_bytes);
+        detail::buffer_writer<typename DynamicBuffer::mutable_buffers_type> w{buffers};
+
+        i.serialize_to(w);
+        for(auto it = first; it != last; ++it)
+            it->serialize_to(w);
+
+        out_.commit(used_bytes);
+        return used_bytes;
+    }
+
+    auto advance(const std::vector<Message>& messages) const{
+        return advance(messages.cbegin(), messages.cend());
+    }
+
+}; // BufferSerializer class
+
+template<class C, class T, class DynamicBuffer>
+auto make_serializer(DynamicBuffer & out){
+    return BufferSerializer<C, T, DynamicBuffer>{out};
+}
+
 } // namespace chat
 
 #endif // CHAT_MESSAGE_HPP
@@ -36,9 +36,9 @@ int main()
         // if it this pull server, an output buffer must be blank
     };
 
-    echo.on_message = [](auto & /*session*/, auto & input, auto & output){
+    echo.on_message = [](auto & session, auto & input, auto & /*output*/){
         cout << boost::beast::buffers(input.data()) << endl;
-        boost::beast::ostream(output) << boost::beast::buffers(input.data()); // echo
+        session.send(session.take_message()); // echo, the received blocks go back as they are
     };
 
     my_http_server.get("/echo", [&echo](auto & req, auto & session){
@@ -63,11 +63,14 @@ int main()
         session.do_read();
     });
 
-    http::base::processor::get().register_signals_handler([](int signal){
+    http::base::processor::get().register_signals_handler([&echo](int signal){
         if(signal == SIGINT)
             http::base::out("Interactive attention signal");
-        else if(signal == SIGTERM)
+        else if(signal == SIGTERM){
+            // let the sessions finish their writes, then stop
             http::base::out("Termination request");
+            return echo.drain(std::chrono::seconds(10));
+        }
         else
             http::base::out("Quit");
         http::base::processor::get().stop();
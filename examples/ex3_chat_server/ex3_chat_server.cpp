@@ -9,6 +9,8 @@
 #include <mutex>
 
 #include "../chat_message.hpp"
+#include "../chat_history.hpp"
+#include "../chat_log.hpp"
 
 template<class Request>
 auto make_response(const Request & req, const std::string & user_body){
@@ -42,8 +44,8 @@ struct session_box{
 // client session storage
 static std::unordered_map<ws::session<true>*, session_box> clients;
 
-// message storage (chat room)
-static std::vector<chat::Message> messages;
+// message storage (chat room), keeps the last 256 messages
+static chat::History history{256};
 
 static std::mutex main_mutex;
 
@@ -51,20 +53,65 @@ auto address_string(const ws::base::connection::ptr & connection){
     return connection->stream().next_layer().remote_endpoint().address().to_string();
 }
 
+// Serialize a message once and queue it on every other client. A session
+// is only written on its own strand, so it gets the message through post.
+// Clients whose connection has ended without a close frame are dropped here
+static void broadcast(const ws::session<true> & from, const chat::Message & message){
+    ws::multi_buffer buffer;
+    chat::make_serializer<chat::Inv, chat::Message>(buffer).advance(&message, &message + 1);
+    ws::shared_message const shared{std::move(buffer), true};
+
+    for(auto client = clients.begin(); client != clients.end();){
+        if(client->second.session_p->finished()){
+            client = clients.erase(client);
+            continue;
+        }
+
+        if(client->first != &from)
+            client->second.session_p->post([shared](auto & other){
+                other.send(shared);
+            });
+        ++client;
+    }
+}
+
 int main()
 {
 
+    // Persistent chat log. Restore the newest messages of the previous run
+    chat::Log journal{"chat_log", [](auto & ec){
+        http::base::fail(ec, "chat log");
+    }};
+    journal.replay(history);
+
     http::server instance;
     wss chat{[](auto & res){
             res.insert(boost::beast::http::field::server, BOOST_BEAST_VERSION_STRING);
         }};
 
+    // A client that cannot keep up with the room is dropped instead of
+    // buffering the room for it without bound
+    chat.options.slow_consumer = ws::slow_consumer_policy::disconnect;
+    chat.options.max_queued_bytes = 1 << 20;
+    chat.options.max_lag = std::chrono::seconds(30);
+
+    // Reconnect storms: at most 200 upgrades/s (the rest wait, up to 2000),
+    // at most 8 connections per address
+    chat.admission.handshakes = {200, 200};
+    chat.admission.max_pending = 2000;
+    chat.admission.max_per_address = 8;
+
+    chat.on_slow_consumer = [](auto & session, auto queued){
+        http::base::out(address_string(session.getConnection()) + " too slow, "
+                        + std::to_string(queued) + " bytes queued. Disconnected");
+    };
+
     chat.on_accept = [](auto & /*session*/, auto & output){
         // Hello msg from server (push request)
         boost::beast::ostream(output) << "What is your name?";
     };
 
-    chat.on_message = [](auto & session, auto & input, auto & output){
+    chat.on_message = [&journal](auto & session, auto & input, auto & output){
 
         auto input_message = boost::beast::buffers_to_string(input.data());
 
@@ -77,22 +124,15 @@ int main()
 
             auto new_client_ = session_box{session.shared_from_this(), input_message.substr(11)};
 
-            messages.push_back({new_client_.nickname, "Input to chat room!"});
+            chat::Message const joined{new_client_.nickname, "Input to chat room!"};
+            history.push(joined);
+            journal.append(joined);
 
-            // Serializing and send last messages to remote host
-            std::string output_string;
-            chat::Serializer<chat::Inv, chat::Message> s{output_string};
-            s.advance(messages);
-            boost::beast::ostream(output) << output_string;
+            // Send last messages to remote host (serialized history)
+            history.write(output);
 
             // Serializing and broadcasting last message
-            for(auto const & client : clients){
-                std::string output_string;
-                chat::Serializer<chat::Inv, chat::Message> s{output_string};
-                s.advance({messages.back()});
-                boost::beast::ostream(client.second.session_p->output()) << output_string;
-                client.second.session_p->do_write();
-            }
+            broadcast(session, joined);
 
             // push new client to the list
             clients.insert({&session, new_client_});
@@ -127,16 +167,21 @@ int main()
         }
         else{
             // Messages is valid!
-            messages.insert(messages.cend(), new_messages.begin(), new_messages.end()); // add msg to list
+            for(auto const & message : new_messages){
+                history.push(message); // add msg to list
+                journal.append(message);
+            }
 
-            // The user must see his message!
-            boost::beast::ostream(output) << input_message;
+            // The user must see his message! Everyone gets the received
+            // blocks, nobody a copy
+            auto const message = session.take_message();
+            session.send(message);
 
             for(auto const & client : clients)
-                if((session.getConnection() != client.second.session_p->getConnection())
-                        && client.second.session_p->getConnection()->stream().next_layer().is_open()){
-                    boost::beast::ostream(client.second.session_p->output()) << input_message; // Broadcasting received messages
-                    client.second.session_p->do_write();
+                if(client.first != &session && !client.second.session_p->finished()){
+                    client.second.session_p->post([message](auto & other){
+                        other.send(message); // Broadcasting received messages
+                    });
                 }
         }
 
@@ -171,23 +216,21 @@ int main()
         });
     };
 
-    chat.on_close = [](auto & session, auto &/* payload*/){
+    chat.on_close = [&journal](auto & session, auto &/* payload*/){
         // client close connection
         std::lock_guard<std::mutex> lock_{main_mutex};
 
-        if(session.getConnection()->stream().next_layer().is_open()){
-            messages.push_back({"is leaving", clients.at(&session).nickname});
+        auto const client = clients.find(&session);
+        if(client == clients.end())
+            return;
 
-            for(auto const & client : clients)
-                if((session.getConnection() != client.second.session_p->getConnection())
-                        && client.second.session_p->getConnection()->stream().next_layer().is_open()){
-                    std::string output_string;
-                    chat::Serializer<chat::Inv, chat::Message> s{output_string};
-                    s.advance({messages.back()});
-                    boost::beast::ostream(client.second.session_p->output()) << output_string; // Broadcasting last message
-                    client.second.session_p->do_write();
-                }
-        }
+        chat::Message const leaving{"is leaving", client->second.nickname};
+        clients.erase(client);
+
+        history.push(leaving);
+        journal.append(leaving);
+
+        broadcast(session, leaving); // Broadcasting last message
     };
 
     instance.get("/ws", [&chat](auto & req, auto & session){
@@ -217,11 +260,14 @@ int main()
         session.do_read();
     });
 
-    http::base::processor::get().register_signals_handler([](int signal){
+    http::base::processor::get().register_signals_handler([&chat](int signal){
         if(signal == SIGINT)
             http::base::out("Interactive attention signal");
-        else if(signal == SIGTERM)
+        else if(signal == SIGTERM){
+            // let the sessions finish their writes, then stop
             http::base::out("Termination request");
+            return chat.drain(std::chrono::seconds(10));
+        }
         else
             http::base::out("Quit");
         http::base::processor::get().stop();
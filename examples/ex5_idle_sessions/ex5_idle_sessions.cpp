@@ -0,0 +1,231 @@
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <server.hpp>
+
+// Measures the resident memory per idle WebSocket connection.
+//
+// Server: ex5_idle_sessions server <port> [hibernate seconds, 0 - off] [handoff socket]
+// Client: ex5_idle_sessions client <port> <connections>
+//
+// Run the client in another process (so its sockets are not counted) with
+// 100000 or 1000000 connections and read the "bytes/session" figure the
+// server prints once the sessions went idle. The client spreads its sockets
+// over 127.0.0.1-127.0.0.255 to get past the ephemeral port range; both
+// processes need a RLIMIT_NOFILE above the connection count.
+//
+// With a handoff socket, a second server started with the same path takes
+// over the listening socket and the idle connections of the running one,
+// which then exits. The client sees no reconnect.
+
+static std::size_t resident_bytes(){
+    std::ifstream statm{"/proc/self/statm"};
+    std::size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+}
+
+static void raise_nofile(){
+    rlimit rl;
+    if(::getrlimit(RLIMIT_NOFILE, &rl) == 0){
+        rl.rlim_cur = rl.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &rl);
+        std::cout << "RLIMIT_NOFILE " << rl.rlim_cur << std::endl;
+    }
+}
+
+static std::atomic<std::size_t> sessions{0};
+
+static void report(boost::asio::steady_timer & timer, std::size_t baseline){
+    timer.expires_after(std::chrono::seconds(5));
+    timer.async_wait([&timer, baseline](auto & ec){
+        if(ec)
+            return;
+
+        auto const count = sessions.load();
+        auto const rss = resident_bytes();
+
+        std::cout << count << " sessions, rss " << rss / 1024 << " KiB";
+        if(count > 0 && rss > baseline)
+            std::cout << ", " << (rss - baseline) / count << " bytes/session";
+        std::cout << std::endl;
+
+        report(timer, baseline);
+    });
+}
+
+static int run_server(uint32_t port, long hibernate_seconds, const std::string & handoff_path){
+    ws::server idle;
+
+    idle.options.hibernate_after = std::chrono::seconds(hibernate_seconds);
+
+    idle.on_accept = [](auto & session, auto & /*output*/){
+        ++sessions;
+        // The timer only drives the idle check, connections are kept open
+        session.launch_timer([](auto & /*session*/){});
+    };
+
+    ws::path_table const routes{
+        {"/idle", [](auto & session, auto & req){
+            session.do_accept(req);
+        }}
+    };
+
+    if(handoff_path.empty())
+        idle.listen("127.0.0.1", port, routes);
+    else{
+        // empty if no server runs on this path
+        ws::handoff::inheritance inherited{handoff_path};
+
+        idle.listen("127.0.0.1", port, routes, inherited);
+        idle.adopt(inherited, [](auto & session){
+            ++sessions;
+            session.launch_timer([](auto & /*session*/){});
+        });
+
+        std::cout << sessions << " sessions taken over" << std::endl;
+
+        idle.accept_handoff(handoff_path);
+    }
+
+    auto const baseline = resident_bytes();
+    boost::asio::steady_timer timer{http::base::processor::get().io_service()};
+    report(timer, baseline);
+
+    http::base::processor::get().register_signals_handler([](int /*signal*/){
+        http::base::processor::get().stop();
+    }, std::vector<int>{SIGINT,SIGTERM, SIGQUIT});
+
+    uint32_t pool_size = boost::thread::hardware_concurrency();
+    http::base::processor::get().start(pool_size == 0 ? 4 : pool_size);
+    http::base::processor::get().wait();
+
+    return 0;
+}
+
+// Opens `count` connections, at most `parallel` handshakes at a time
+class idle_client{
+
+    static constexpr char const* upgrade =
+            "GET /idle HTTP/1.1\r\n"
+            "Host: 127.0.0.1\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+            "Sec-WebSocket-Version: 13\r\n\r\n";
+
+    struct connection{
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::streambuf response;
+
+        explicit connection(boost::asio::io_context & ioc)
+            : socket{ioc}
+        {}
+    };
+
+    boost::asio::io_context & ioc_;
+    boost::asio::ip::tcp::endpoint endpoint_;
+    std::size_t count_;
+    std::size_t next_ = 0;
+    std::size_t done_ = 0;
+    std::vector<std::unique_ptr<connection>> connections_;
+
+    void start_one(){
+        if(next_ == count_)
+            return;
+
+        auto const index = next_++;
+        connections_.push_back(std::make_unique<connection>(ioc_));
+        auto & c = *connections_.back();
+
+        boost::system::error_code ec;
+        c.socket.open(boost::asio::ip::tcp::v4(), ec);
+        c.socket.bind({boost::asio::ip::address_v4{static_cast<uint32_t>(0x7f000001 + index / 50000 % 255)}, 0}, ec);
+
+        c.socket.async_connect(endpoint_, [this, &c](auto & ec){
+            if(ec)
+                return on_done(ec);
+
+            boost::asio::async_write(c.socket, boost::asio::buffer(upgrade, std::strlen(upgrade)),
+                                     [this, &c](auto & ec, std::size_t){
+                if(ec)
+                    return on_done(ec);
+
+                boost::asio::async_read_until(c.socket, c.response, "\r\n\r\n",
+                                              [this](auto & ec, std::size_t){
+                    on_done(ec);
+                });
+            });
+        });
+    }
+
+    void on_done(const boost::system::error_code & ec){
+        if(ec)
+            http::base::fail(ec, "connect");
+
+        if(++done_ % 10000 == 0 || done_ == count_)
+            std::cout << done_ << " connections" << std::endl;
+
+        start_one();
+    }
+
+public:
+
+    idle_client(boost::asio::io_context & ioc, uint32_t port, std::size_t count)
+        : ioc_{ioc},
+          endpoint_{boost::asio::ip::make_address("127.0.0.1"), static_cast<unsigned short>(port)},
+          count_{count}
+    {
+        connections_.reserve(count);
+    }
+
+    void run(std::size_t parallel){
+        for(std::size_t i = 0; i < parallel; ++i)
+            start_one();
+    }
+
+};
+
+static int run_client(uint32_t port, std::size_t count){
+    boost::asio::io_context ioc;
+
+    idle_client client{ioc, port, count};
+    client.run(512);
+
+    ioc.run();
+    std::cout << "connections are idle, ctrl+c to quit" << std::endl;
+
+    // keep the sockets open
+    ::pause();
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 3){
+        std::cout << "Usage: ex5_idle_sessions server <port> [hibernate seconds] [handoff socket]\n"
+                  << "       ex5_idle_sessions client <port> <connections>" << std::endl;
+        return -1;
+    }
+
+    raise_nofile();
+
+    std::string const mode = argv[1];
+    auto const port = static_cast<uint32_t>(std::atoi(argv[2]));
+
+    if(mode == "server")
+        return run_server(port, argc > 3 ? std::atol(argv[3]) : 5, argc > 4 ? argv[4] : "");
+
+    if(mode == "client" && argc > 3)
+        return run_client(port, static_cast<std::size_t>(std::atol(argv[3])));
+
+    return -1;
+}
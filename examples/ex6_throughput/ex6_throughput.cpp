@@ -0,0 +1,321 @@
+#include <iostream>
+#include <fstream>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <server.hpp>
+
+// Echo throughput and syscall cost of the server io.
+//
+// Server: ex6_throughput server <port> [threads] [spin cpu]
+// Client: ex6_throughput client <port> <connections> [message size] [threads]
+//
+// Each client connection keeps one message in flight and sends the next
+// one when the echo arrives. Every 5 seconds the server prints messages/s,
+// syscalls per message, CPU time per message and context switches per
+// second; the client prints the round trip percentiles.
+// Syscalls are counted by the kernel on the raw_syscalls:sys_enter
+// tracepoint, so sendmsg, recvmsg, epoll_wait and io_uring_enter count
+// like read and write. The tracepoint needs tracefs access (root, or
+// perf_event_paranoid <= -1 and a readable tracefs); without it only the
+// read and write syscalls of /proc/self/io are counted.
+// With a spin cpu the server runs the low latency profile: one spinning
+// thread pinned to that cpu instead of the thread pool, and
+// TCP_NODELAY, TCP_QUICKACK and SO_BUSY_POLL on accepted sockets. For the
+// loopback latency run a single connection with the client pinned to
+// another isolated cpu, e.g.
+//          taskset -c 2 ex6_throughput server 8080 1 3
+//          taskset -c 4 ex6_throughput client 8080 1 64 1
+// Build once as is (epoll) and once with -DBEAST_WEBSOCKET_IO_URING=ON and
+// compare the figures of the two servers under the same client load.
+
+struct sample{
+    std::uint64_t messages;
+    std::uint64_t syscalls;
+    double cpu_seconds;
+    long context_switches;
+};
+
+static std::atomic<std::uint64_t> messages{0};
+
+// perf counter of raw_syscalls:sys_enter, -1 if not available
+static int syscall_counter = -1;
+
+// Counts the syscalls of the calling thread and of every thread it starts
+// from now on, open it before the io threads
+static int open_syscall_counter(){
+#if defined(__linux__)
+    char const* const paths[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                                 "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+
+    for(auto const path : paths){
+        std::ifstream id_file{path};
+        std::uint64_t id;
+        if(!(id_file >> id))
+            continue;
+
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = id;
+        attr.inherit = 1;
+
+        return static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    }
+#endif
+    return -1;
+}
+
+static sample take_sample(){
+    sample s{messages.load(std::memory_order_relaxed), 0, 0, 0};
+
+    std::uint64_t count;
+    if(syscall_counter >= 0 && ::read(syscall_counter, &count, sizeof(count)) == sizeof(count))
+        s.syscalls = count;
+    else{
+        std::ifstream io{"/proc/self/io"};
+        std::string key;
+        std::uint64_t value;
+        while(io >> key >> value)
+            if(key == "syscr:" || key == "syscw:")
+                s.syscalls += value;
+    }
+
+    rusage ru;
+    if(::getrusage(RUSAGE_SELF, &ru) == 0){
+        s.cpu_seconds = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+                + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+        s.context_switches = ru.ru_nvcsw + ru.ru_nivcsw;
+    }
+
+    return s;
+}
+
+static void report(boost::asio::steady_timer & timer, sample last){
+    timer.expires_after(std::chrono::seconds(5));
+    timer.async_wait([&timer, last](const boost::system::error_code & ec){
+        if(ec)
+            return;
+
+        auto const now = take_sample();
+        auto const n = now.messages - last.messages;
+
+        std::cout << ws::io_backend() << ": " << n / 5 << " msg/s";
+        if(n > 0)
+            std::cout << ", " << static_cast<double>(now.syscalls - last.syscalls) / n << (syscall_counter >= 0 ? " syscalls/msg" : " read/write syscalls/msg")
+                      << ", " << (now.cpu_seconds - last.cpu_seconds) * 1e6 / n << " cpu us/msg"
+                      << ", " << (now.context_switches - last.context_switches) / 5 << " ctx switches/s"
+                      << ", " << ws::read_batch_stats().mean() << " msgs/wakeup";
+        std::cout << std::endl;
+
+        report(timer, now);
+    });
+}
+
+static int run_server(uint32_t port, uint32_t threads, int spin_cpu){
+    syscall_counter = open_syscall_counter();
+    if(syscall_counter < 0)
+        std::cout << "raw_syscalls:sys_enter not available, counting read/write syscalls only" << std::endl;
+
+    ws::server echo;
+
+    if(spin_cpu >= 0)
+        echo.options.socket = {true, true, std::chrono::microseconds(50)};
+
+    echo.on_message = [](auto & /*session*/, auto & input, auto & output){
+        messages.fetch_add(1, std::memory_order_relaxed);
+        output.commit(boost::asio::buffer_copy(output.prepare(input.size()), input.data()));
+    };
+
+    echo.listen("127.0.0.1", port, {
+        {"/echo", [](auto & session, auto & req){
+            session.do_accept(req);
+        }}
+    });
+
+    boost::asio::steady_timer timer{http::base::processor::get().io_service()};
+    report(timer, take_sample());
+
+    http::base::processor::get().register_signals_handler([](int /*signal*/){
+        http::base::processor::get().stop();
+    }, std::vector<int>{SIGINT,SIGTERM, SIGQUIT});
+
+    if(spin_cpu >= 0){
+        // the spinning thread returns once the processor is stopped
+        ws::base::spin_thread spin;
+        spin.start(http::base::processor::get().io_service(), spin_cpu);
+        spin.join();
+        return 0;
+    }
+
+    http::base::processor::get().start(threads);
+    http::base::processor::get().wait();
+
+    return 0;
+}
+
+// Round trip times in microseconds, 1 us buckets up to 10 ms
+class latency_histogram{
+
+    std::array<std::atomic<std::uint64_t>, 10001> buckets_{};
+
+public:
+
+    void add(std::chrono::steady_clock::duration rtt){
+        std::int64_t const us = std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+        buckets_[static_cast<std::size_t>((std::min)(us, static_cast<std::int64_t>(buckets_.size() - 1)))]
+                .fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // "p50 .. us, p99 .. us, p99.9 .. us", and reset
+    std::string take(){
+        std::vector<std::uint64_t> counts(buckets_.size());
+        std::uint64_t total = 0;
+        for(std::size_t i = 0; i < buckets_.size(); ++i)
+            total += counts[i] = buckets_[i].exchange(0, std::memory_order_relaxed);
+
+        std::ostringstream out;
+        out << total / 5 << " msg/s";
+
+        double const quantiles[] = {0.5, 0.99, 0.999};
+        char const* names[] = {"p50", "p99", "p99.9"};
+
+        std::uint64_t seen = 0;
+        std::size_t q = 0;
+        for(std::size_t i = 0; i < counts.size() && q < 3 && total > 0; ++i){
+            seen += counts[i];
+            while(q < 3 && seen >= quantiles[q] * total)
+                out << ", " << names[q++] << " " << i << (i + 1 == counts.size() ? "+" : "") << " us";
+        }
+
+        return out.str();
+    }
+
+};
+
+static latency_histogram round_trips;
+
+// One message in flight per connection
+class echo_client : public std::enable_shared_from_this<echo_client>{
+
+    boost::beast::websocket::stream<boost::asio::ip::tcp::socket> stream_;
+    std::string message_;
+    boost::beast::flat_buffer buffer_;
+    std::chrono::steady_clock::time_point sent_at_;
+
+    void fail(const boost::system::error_code & ec, const char* what){
+        http::base::fail(ec, what);
+    }
+
+    void send(){
+        sent_at_ = std::chrono::steady_clock::now();
+        stream_.async_write(boost::asio::buffer(message_),
+                            [self = shared_from_this()](const boost::system::error_code & ec, std::size_t){
+            if(ec)
+                return self->fail(ec, "write");
+            self->receive();
+        });
+    }
+
+    void receive(){
+        stream_.async_read(buffer_, [self = shared_from_this()](const boost::system::error_code & ec, std::size_t){
+            if(ec)
+                return self->fail(ec, "read");
+            round_trips.add(std::chrono::steady_clock::now() - self->sent_at_);
+            self->buffer_.consume(self->buffer_.size());
+            self->send();
+        });
+    }
+
+public:
+
+    echo_client(boost::asio::io_context & ioc, std::size_t size)
+        : stream_{ioc},
+          message_(size, 'x')
+    {
+        stream_.binary(true);
+    }
+
+    void run(const boost::asio::ip::tcp::endpoint & endpoint){
+        stream_.next_layer().async_connect(endpoint, [self = shared_from_this()](const boost::system::error_code & ec){
+            if(ec)
+                return self->fail(ec, "connect");
+
+            boost::system::error_code ec_;
+            self->stream_.next_layer().set_option(boost::asio::ip::tcp::no_delay(true), ec_);
+
+            self->stream_.async_handshake("127.0.0.1", "/echo", [self](const boost::system::error_code & ec){
+                if(ec)
+                    return self->fail(ec, "handshake");
+                self->send();
+            });
+        });
+    }
+
+};
+
+static int run_client(uint32_t port, std::size_t connections, std::size_t size, uint32_t threads){
+    boost::asio::io_context ioc;
+    boost::asio::ip::tcp::endpoint const endpoint{boost::asio::ip::make_address("127.0.0.1"),
+                                                  static_cast<unsigned short>(port)};
+
+    for(std::size_t i = 0; i < connections; ++i)
+        std::make_shared<echo_client>(ioc, size)->run(endpoint);
+
+    std::thread reporter{[]{
+        for(;;){
+            std::this_thread::sleep_for(std::chrono::seconds(5));
+            std::cout << round_trips.take() << std::endl;
+        }
+    }};
+    reporter.detach();
+
+    std::vector<std::thread> pool;
+    for(uint32_t i = 1; i < threads; ++i)
+        pool.emplace_back([&ioc]{ ioc.run(); });
+    ioc.run();
+
+    for(auto & t : pool)
+        t.join();
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 3){
+        std::cout << "Usage: ex6_throughput server <port> [threads] [spin cpu]\n"
+                  << "       ex6_throughput client <port> <connections> [message size] [threads]" << std::endl;
+        return -1;
+    }
+
+    std::string const mode = argv[1];
+    auto const port = static_cast<uint32_t>(std::atoi(argv[2]));
+    uint32_t const cores = boost::thread::hardware_concurrency() == 0 ? 4 : boost::thread::hardware_concurrency();
+
+    if(mode == "server"){
+        return run_server(port, argc > 3 ? static_cast<uint32_t>(std::atoi(argv[3])) : cores,
+                          argc > 4 ? std::atoi(argv[4]) : -1);
+    }
+
+    if(mode == "client" && argc > 3)
+        return run_client(port,
+                          static_cast<std::size_t>(std::atol(argv[3])),
+                          argc > 4 ? static_cast<std::size_t>(std::atol(argv[4])) : 64,
+                          argc > 5 ? static_cast<uint32_t>(std::atoi(argv[5])) : cores);
+
+    return -1;
+}
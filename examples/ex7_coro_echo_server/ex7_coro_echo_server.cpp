@@ -0,0 +1,69 @@
+#include <iostream>
+
+#include <server.hpp>
+#include <BeastHttp/include/server.hpp>
+
+#include <boost/asio/spawn.hpp>
+
+using namespace std;
+
+int main()
+{
+
+    http::server my_http_server;
+    ws::server echo;
+
+    my_http_server.get("/echo", [&echo](auto & req, auto & session){
+        cout << req << endl;
+        // See if it is a WebSocket Upgrade
+        if(boost::beast::websocket::is_upgrade(req))
+        {
+            // one coroutine per connection, on the strand of its session
+            echo.upgrade_coro(session.getConnection(), [req](ws::coro::session::ptr session){
+                boost::asio::spawn(session->get_executor(), [session, req](boost::asio::yield_context yield){
+                    boost::system::error_code ec;
+
+                    session->accept(req, yield[ec]);
+                    if(ec)
+                        return ws::logging::fail(ec, "accept");
+
+                    for(;;){
+                        session->read(yield[ec]);
+                        if(ec == boost::beast::websocket::error::closed)
+                            return;
+                        if(ec)
+                            return ws::logging::fail(ec, "read");
+
+                        cout << boost::beast::buffers(session->input().data()) << endl;
+
+                        session->write(session->input().data(), yield[ec]);
+                        if(ec)
+                            return ws::logging::fail(ec, "write");
+                    }
+                });
+            });
+        }
+
+    });
+
+    my_http_server.listen("127.0.0.1", 80, [](auto & session){
+        http::base::out(session.getConnection()->stream().remote_endpoint().address().to_string() + " connected");
+        session.do_read();
+    });
+
+    http::base::processor::get().register_signals_handler([](int signal){
+        if(signal == SIGINT)
+            http::base::out("Interactive attention signal");
+        else if(signal == SIGTERM)
+            http::base::out("Termination request");
+        else
+            http::base::out("Quit");
+        http::base::processor::get().stop();
+    }, std::vector<int>{SIGINT,SIGTERM, SIGQUIT});
+
+    uint32_t pool_size = boost::thread::hardware_concurrency();
+    http::base::processor::get().start(pool_size == 0 ? 4 : pool_size << 1);
+    http::base::processor::get().wait();
+
+    return 0;
+}
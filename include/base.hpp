@@ -3,15 +3,40 @@
 
 #include <BeastHttp/include/base.hpp>
 
+#include "logging.hpp"
+#include "read_batch.hpp"
+
 #include <boost/beast/websocket.hpp>
+#include <boost/version.hpp>
 
 
 #if BEAST_HTTP_VERSION < 104
 #error "BEAST_HTTP_VERSION must be >= 104"
 #endif
 
+// Socket io on io_uring (cmake -DBEAST_WEBSOCKET_IO_URING=ON) defines
+// BOOST_ASIO_HAS_IO_URING and BOOST_ASIO_DISABLE_EPOLL
+#if defined(BOOST_ASIO_HAS_IO_URING) && BOOST_VERSION < 107800
+#error "io_uring socket io needs Boost 1.78 or later"
+#endif
+
 namespace ws {
 
+/// \brief Reactor the sockets run on, chosen at build time
+inline const char* io_backend(){
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+    return "io_uring";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+    return "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+    return "kqueue";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+    return "iocp";
+#else
+    return "select";
+#endif
+}
+
 namespace base {
 
 /// \brief The connection class
@@ -34,6 +59,10 @@ public:
         : strand_{executor}, host_{host}
     {}
 
+    auto & strand(){
+        return strand_;
+    }
+
     template<class F>
     void async_handshake(boost::beast::string_view target,
                          F&& f){
@@ -81,6 +110,32 @@ public:
     }
 
 
+    template <class F, class B, class P>
+    void async_read_upgrade(B& buf, P& parser, F&& f){
+        boost::beast::http::async_read(
+                    derived().stream().next_layer(),
+                    buf, parser,
+                    boost::asio::bind_executor(
+                        strand_, std::forward<F>(f)));
+    }
+
+    template <class F, class B>
+    void async_write_raw(const B& buffers, F&& f){
+        boost::asio::async_write(
+                    derived().stream().next_layer(),
+                    buffers,
+                    boost::asio::bind_executor(
+                        strand_, std::forward<F>(f)));
+    }
+
+    template <class F>
+    void async_wait_raw(boost::asio::socket_base::wait_type type, F&& f){
+        derived().stream().next_layer().async_wait(
+                    type,
+                    boost::asio::bind_executor(
+                        strand_, std::forward<F>(f)));
+    }
+
     template <class F, class B>
     void async_write(const B& buf, F&& f){
         derived().stream().async_write(
@@ -89,6 +144,14 @@ public:
                         strand_, std::forward<F>(f)));
     }
 
+    template <class F, class B>
+    void async_write_some(bool fin, const B& buffers, F&& f){
+        derived().stream().async_write_some(
+                    fin, buffers,
+                    boost::asio::bind_executor(
+                        strand_, std::forward<F>(f)));
+    }
+
     template <class F, class B>
     void async_read(B& buf, F&& f){
         derived().stream().async_read(
@@ -97,6 +160,36 @@ public:
                         strand_, std::forward<F>(f)));
     }
 
+    /// \brief Read a message, in place if the stream holds it and the
+    /// batch is armed (see read_batch)
+    template <class F, class B>
+    void async_read(B& buf, read_batch& batch, F&& f){
+        derived().stream().async_read(
+                    buf,
+                    boost::asio::bind_executor(
+                        batch_executor<decltype(strand_)>{strand_, batch},
+                        std::forward<F>(f)));
+    }
+
+    template <class F, class B>
+    void async_read_some(const B& buffers, F&& f){
+        derived().stream().async_read_some(
+                    buffers,
+                    boost::asio::bind_executor(
+                        strand_, std::forward<F>(f)));
+    }
+
+    /// \brief Read some bytes through the executor of the reads (see
+    /// read_batch)
+    template <class F, class B>
+    void async_read_some(const B& buffers, read_batch& batch, F&& f){
+        derived().stream().async_read_some(
+                    buffers,
+                    boost::asio::bind_executor(
+                        batch_executor<decltype(strand_)>{strand_, batch},
+                        std::forward<F>(f)));
+    }
+
     template<class F>
     void async_ping(boost::beast::websocket::ping_data const & payload, F&& f){
         derived().stream().async_ping(payload,
@@ -125,7 +218,7 @@ public:
         derived().stream().accept(r, ec);
 
         if(ec)
-            http::base::fail(ec, "accept");
+            logging::fail(ec, "accept");
 
         return ec;
     }
@@ -137,7 +230,7 @@ public:
         derived().stream().accept_ex(r, d, ec);
 
         if(ec)
-            http::base::fail(ec, "accept");
+            logging::fail(ec, "accept");
 
         return ec;
     }
@@ -148,7 +241,7 @@ public:
         derived().stream().handshake(host_, target, ec);
 
         if(ec)
-            http::base::fail(ec, "handshake");
+            logging::fail(ec, "handshake");
 
         return ec;
     }
@@ -160,7 +253,7 @@ public:
         derived().stream().handshake(res, host_, target, ec);
 
         if(ec)
-            http::base::fail(ec, "handshake");
+            logging::fail(ec, "handshake");
 
         return ec;
     }
@@ -173,7 +266,7 @@ public:
         derived().stream().handshake_ex(host_, target, d, ec);
 
         if(ec)
-            http::base::fail(ec, "handshake");
+            logging::fail(ec, "handshake");
 
         return ec;
     }
@@ -187,7 +280,7 @@ public:
         derived().stream().handshake_ex(res, host_, target, d, ec);
 
         if(ec)
-            http::base::fail(ec, "handshake");
+            logging::fail(ec, "handshake");
 
         return ec;
     }
@@ -199,7 +292,7 @@ public:
         derived().stream().write(buf.data(), ec);
 
         if(ec)
-            http::base::fail(ec, "write");
+            logging::fail(ec, "write");
 
         return ec;
     }
@@ -211,7 +304,7 @@ public:
         derived().stream().read(buf, ec);
 
         if(ec)
-            http::base::fail(ec, "read");
+            logging::fail(ec, "read");
 
         return ec;
     }
@@ -222,7 +315,7 @@ public:
         derived().stream().ping(payload, ec);
 
         if(ec)
-            http::base::fail(ec, "ping");
+            logging::fail(ec, "ping");
 
         return ec;
     }
@@ -233,7 +326,7 @@ public:
         derived().stream().pong(payload, ec);
 
         if(ec)
-            http::base::fail(ec, "pong");
+            logging::fail(ec, "pong");
 
         return ec;
     }
@@ -244,7 +337,7 @@ public:
         derived().stream().close(reason);
 
         if(ec)
-            http::base::fail(ec, "close");
+            logging::fail(ec, "close");
 
         return ec;
     }
@@ -294,7 +387,7 @@ public:
         ws_.next_layer().connect(endpoint, ec);
 
         if(ec)
-            http::base::fail(ec, "connect");
+            logging::fail(ec, "connect");
     }
 
     auto & stream(){
@@ -16,11 +16,14 @@ class client_impl{
                                                      port,
                                                      [this, host, on_error = std::forward<Callback0>(on_error_handler)](const boost::system::error_code & ec){
             if(ec){
-                http::base::fail(ec, "connect");
+                logging::fail(ec, "connect");
                 on_error(ec);
                 return;
             }
 
+            if(read_message_max > 0)
+                connection_p_->stream().read_message_max(read_message_max);
+
             session<false>::on_connect(connection_p_, decorator_, on_connect, on_handshake, on_message, on_ping, on_pong, on_close);
         });
 
@@ -42,6 +45,9 @@ public:
     std::function<void(session<false>&, const boost::beast::string_view&)> on_pong;
     std::function<void(session<false>&, const boost::beast::string_view&)> on_close;
 
+    // Largest message the server may send, zero keeps the stream default
+    std::uint64_t read_message_max = 0;
+
     explicit client_impl()
         : connection_p_{nullptr}
     {}
@@ -0,0 +1,251 @@
+#ifndef BEAST_WS_CORO_HPP
+#define BEAST_WS_CORO_HPP
+
+#include "session.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+#include <boost/asio/use_awaitable.hpp>
+#endif
+
+namespace ws {
+
+namespace coro {
+
+/// \brief Coroutine front end of a WebSocket connection
+/// Every operation takes an Asio completion token: the `yield` of
+/// boost::asio::spawn (C++14) or boost::asio::use_awaitable (C++20, the
+/// default when the compiler supports co_await). The session state is the
+/// coroutine itself, there are no do_*/on_* pairs, no std::function and no
+/// bound handler copies per step. Operation state is allocated through the
+/// handler allocation hooks of Asio, which recycle it per thread.
+/// Run the coroutine on get_executor() (the connection strand). Made by
+/// server_impl::upgrade_coro, which admits it like any other session.
+class session : private boost::noncopyable,
+        public std::enable_shared_from_this<session>
+{
+
+    base::connection connection_;
+
+    // bytes read past the upgrade request (see server_impl::upgrade_session)
+    boost::beast::flat_buffer handshake_buffer_;
+
+    multi_buffer input_buffer_;
+
+    const std::function<void(boost::beast::websocket::response_type&)> & decorator_cb_;
+
+    // Closes the socket once the deadline has passed, so the operation in
+    // flight completes with an error. An operation moves the deadline
+    // without touching the timer; the timer waits again if it has moved.
+    boost::asio::steady_timer timer_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::chrono::steady_clock::duration timeout_ = std::chrono::seconds(10);
+
+    // per-address slot of the handshake gate, held for the connection's life
+    base::handshake_gate::ticket ticket_;
+
+    void arm(){
+        if(timeout_ > std::chrono::steady_clock::duration::zero())
+            deadline_ = std::chrono::steady_clock::now() + timeout_;
+        else
+            deadline_ = (std::chrono::steady_clock::time_point::max)();
+    }
+
+    void launch_timer(){
+        timer_.expires_at(deadline_);
+
+        std::weak_ptr<session> weak = shared_from_this();
+        timer_.async_wait(
+                    boost::asio::bind_executor(
+                        connection_.strand(),
+                        [weak](const boost::system::error_code & ec){
+            // gone with the coroutine
+            auto const self = weak.lock();
+            if(!self || ec == boost::asio::error::operation_aborted)
+                return;
+
+            self->on_timer(ec);
+        }));
+    }
+
+    void on_timer(const boost::system::error_code & ec){
+        if(ec)
+            return logging::fail(ec, "timer");
+
+        if(deadline_ > std::chrono::steady_clock::now())
+            return launch_timer();
+
+        boost::system::error_code ec_;
+        connection_.stream().next_layer().close(ec_);
+    }
+
+    // The decorator is a stream option since Boost 1.70, accept_ex before
+    template<class Request, class CompletionToken>
+    auto accept_with_decorator(const Request & req, CompletionToken && token){
+#if BOOST_VERSION >= 107000
+        if(decorator_cb_)
+            connection_.stream().set_option(boost::beast::websocket::stream_base::decorator(decorator_cb_));
+
+        return connection_.stream().async_accept(req, std::forward<CompletionToken>(token));
+#else
+        if(decorator_cb_)
+            return connection_.stream().async_accept_ex(req, decorator_cb_,
+                                                        std::forward<CompletionToken>(token));
+
+        return connection_.stream().async_accept(req, std::forward<CompletionToken>(token));
+#endif
+    }
+
+public:
+
+    using ptr = std::shared_ptr<session>;
+
+    explicit session(boost::asio::ip::tcp::socket&& socket,
+                     boost::beast::flat_buffer&& buffer,
+                     const session_options & options,
+                     const std::function<void(boost::beast::websocket::response_type&)> & decorator_cb)
+        : connection_{std::move(socket)},
+          handshake_buffer_{std::move(buffer)},
+          decorator_cb_{decorator_cb},
+          timer_{connection_.strand().get_inner_executor(), (std::chrono::steady_clock::time_point::max)()}
+    {
+        if(options.read_message_max > 0)
+            connection_.stream().read_message_max(options.read_message_max);
+
+        if(options.socket.enabled())
+            base::tune_socket(connection_.stream().next_layer(), options.socket);
+
+        memory_budget::get().open_session();
+    }
+
+    ~session(){
+        memory_budget::get().close_session();
+    }
+
+    static ptr make(boost::asio::ip::tcp::socket&& socket,
+                    boost::beast::flat_buffer&& buffer,
+                    const session_options & options,
+                    const std::function<void(boost::beast::websocket::response_type&)> & decorator_cb)
+    {
+        return std::allocate_shared<session>(base::pool_allocator<session>{},
+                                             std::move(socket), std::move(buffer), options, decorator_cb);
+    }
+
+    auto get_executor(){
+        return connection_.strand();
+    }
+
+    auto & getConnection(){
+        return connection_;
+    }
+
+    void hold(base::handshake_gate::ticket&& ticket){
+        ticket_ = std::move(ticket);
+    }
+
+    /// \brief Longest time an operation may take, the socket is closed past
+    /// it (10 s, as session<true>). Zero waits without limit
+    void timeout(std::chrono::steady_clock::duration d){
+        timeout_ = d;
+    }
+
+    /// \brief Last message received by read()
+    auto & input(){
+        return input_buffer_;
+    }
+
+    /// \brief Accept the upgrade request, with the response decorator of the
+    /// server. Starts the timer
+    template<class Request, class CompletionToken>
+    auto accept(const Request & req, CompletionToken && token){
+        arm();
+        launch_timer();
+
+        if(handshake_buffer_.size() > 0){
+            boost::beast::flat_buffer raw;
+            boost::beast::ostream(raw) << req;
+            raw.commit(boost::asio::buffer_copy(raw.prepare(handshake_buffer_.size()),
+                                                handshake_buffer_.data()));
+            handshake_buffer_ = std::move(raw);
+
+            return accept_with_decorator(handshake_buffer_.data(), std::forward<CompletionToken>(token));
+        }
+
+        return accept_with_decorator(req, std::forward<CompletionToken>(token));
+    }
+
+    /// \brief Read the next message into input(), replacing the previous one
+    template<class CompletionToken>
+    auto read(CompletionToken && token){
+        arm();
+        input_buffer_.consume(input_buffer_.size());
+        return connection_.stream().async_read(input_buffer_,
+                                               std::forward<CompletionToken>(token));
+    }
+
+    template<class ConstBufferSequence, class CompletionToken>
+    auto write(const ConstBufferSequence & buffers, CompletionToken && token){
+        arm();
+        return connection_.stream().async_write(buffers,
+                                                std::forward<CompletionToken>(token));
+    }
+
+    template<class CompletionToken>
+    auto ping(boost::beast::websocket::ping_data const & payload, CompletionToken && token){
+        arm();
+        return connection_.stream().async_ping(payload,
+                                               std::forward<CompletionToken>(token));
+    }
+
+    template<class CompletionToken>
+    auto pong(boost::beast::websocket::ping_data const & payload, CompletionToken && token){
+        arm();
+        return connection_.stream().async_pong(payload,
+                                               std::forward<CompletionToken>(token));
+    }
+
+    template<class CompletionToken>
+    auto close(boost::beast::websocket::close_reason const & reason, CompletionToken && token){
+        arm();
+        return connection_.stream().async_close(reason,
+                                                std::forward<CompletionToken>(token));
+    }
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+
+    template<class Request>
+    auto accept(const Request & req){
+        return accept(req, boost::asio::use_awaitable);
+    }
+
+    auto read(){
+        return read(boost::asio::use_awaitable);
+    }
+
+    template<class ConstBufferSequence>
+    auto write(const ConstBufferSequence & buffers){
+        return write(buffers, boost::asio::use_awaitable);
+    }
+
+    auto ping(boost::beast::websocket::ping_data const & payload){
+        return ping(payload, boost::asio::use_awaitable);
+    }
+
+    auto pong(boost::beast::websocket::ping_data const & payload){
+        return pong(payload, boost::asio::use_awaitable);
+    }
+
+    auto close(boost::beast::websocket::close_reason const & reason){
+        return close(reason, boost::asio::use_awaitable);
+    }
+
+#endif // BOOST_ASIO_HAS_CO_AWAIT
+
+}; // session class
+
+} // namespace coro
+
+} // namespace ws
+
+#endif // BEAST_WS_CORO_HPP
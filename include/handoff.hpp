@@ -0,0 +1,383 @@
+#ifndef BEAST_WS_HANDOFF_HPP
+#define BEAST_WS_HANDOFF_HPP
+
+#include "base.hpp"
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/beast/core/string.hpp>
+#include <boost/beast/websocket/stream.hpp>
+#include <boost/core/ignore_unused.hpp>
+#include <boost/core/noncopyable.hpp>
+#include <boost/version.hpp>
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace ws {
+
+namespace handoff {
+
+/// \brief Send one record: a payload and at most one descriptor (-1 for none)
+/// Records are length prefixed, the descriptor travels with the prefix.
+inline bool send_record(int channel, boost::beast::string_view payload, int fd,
+                        boost::system::error_code & ec){
+    std::uint32_t const size = static_cast<std::uint32_t>(payload.size());
+
+    iovec iov[2];
+    iov[0].iov_base = const_cast<std::uint32_t*>(&size);
+    iov[0].iov_len = sizeof(size);
+    iov[1].iov_base = const_cast<char*>(payload.data());
+    iov[1].iov_len = payload.size();
+
+    union{
+        cmsghdr align;
+        char data[CMSG_SPACE(sizeof(int))];
+    } control;
+    std::memset(&control, 0, sizeof(control));
+
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if(fd >= 0){
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof(control.data);
+
+        auto const cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    std::size_t left = sizeof(size) + payload.size();
+
+    while(left > 0){
+        auto const n = ::sendmsg(channel, &msg, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            ec.assign(errno, boost::system::system_category());
+            return false;
+        }
+
+        // the descriptor went with the first bytes
+        msg.msg_control = nullptr;
+        msg.msg_controllen = 0;
+
+        left -= static_cast<std::size_t>(n);
+        for(auto done = static_cast<std::size_t>(n); done > 0;){
+            auto const step = (std::min)(done, msg.msg_iov->iov_len);
+            msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + step;
+            msg.msg_iov->iov_len -= step;
+            done -= step;
+            if(msg.msg_iov->iov_len == 0 && msg.msg_iovlen > 1){
+                ++msg.msg_iov;
+                --msg.msg_iovlen;
+            }
+        }
+    }
+
+    return true;
+}
+
+/// \brief Receive one record written by send_record
+/// \return false at the end of the stream or on error (ec set)
+inline bool receive_record(int channel, std::string & payload, int & fd,
+                           boost::system::error_code & ec){
+    fd = -1;
+    ec = {};
+
+    std::uint32_t size = 0;
+    iovec iov{&size, sizeof(size)};
+
+    union{
+        cmsghdr align;
+        char data[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+
+#if defined(MSG_CMSG_CLOEXEC)
+    int const flags = MSG_WAITALL | MSG_CMSG_CLOEXEC;
+#else
+    int const flags = MSG_WAITALL;
+#endif
+
+    ssize_t n;
+    do
+        n = ::recvmsg(channel, &msg, flags);
+    while(n < 0 && errno == EINTR);
+
+    if(n <= 0){
+        if(n < 0)
+            ec.assign(errno, boost::system::system_category());
+        return false;
+    }
+
+    for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    if(static_cast<std::size_t>(n) < sizeof(size)){
+        ec = boost::asio::error::eof;
+    }
+    else{
+        payload.resize(size);
+        for(std::size_t done = 0; done < size;){
+            auto const r = ::read(channel, &payload[done], size - done);
+            if(r < 0 && errno == EINTR)
+                continue;
+            if(r <= 0){
+                ec = r < 0 ? boost::system::error_code{errno, boost::system::system_category()}
+                           : boost::system::error_code{boost::asio::error::eof};
+                break;
+            }
+            done += static_cast<std::size_t>(r);
+        }
+    }
+
+    if(ec && fd >= 0){
+        ::close(fd);
+        fd = -1;
+    }
+
+    return !ec;
+}
+
+/// \brief Byte a successor sends to ask for the handoff, a connection
+/// that closes without it is a probe (see accepting)
+constexpr char request = 'h';
+
+inline bool unix_address(const std::string & path, sockaddr_un & address){
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path))
+        return false;
+    std::memcpy(address.sun_path, path.data(), path.size());
+    return true;
+}
+
+/// \brief Whether a process accepts handoff requests at `path`
+/// Sends no request, the process goes on as before.
+/// \return false with ec clear if nobody listens there
+inline bool accepting(const std::string & path, boost::system::error_code & ec){
+    ec = {};
+
+    sockaddr_un address;
+    if(!unix_address(path, address)){
+        ec = boost::asio::error::name_too_long;
+        return false;
+    }
+
+    int const probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(probe < 0){
+        ec.assign(errno, boost::system::system_category());
+        return false;
+    }
+
+    bool const connected = ::connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    if(!connected && errno != ECONNREFUSED && errno != ENOENT)
+        ec.assign(errno, boost::system::system_category());
+
+    ::close(probe);
+    return connected;
+}
+
+/// \brief Boost versions whose websocket stream layout stream_quiet was
+/// validated against. Outside them sessions are not handed off but drained,
+/// only listeners go to the next process. Define BEAST_WS_HANDOFF_SESSIONS
+/// to 0 to turn session handoff off on a validated version too.
+#define BEAST_WS_HANDOFF_BOOST_MIN 107000
+#define BEAST_WS_HANDOFF_BOOST_MAX 107400
+
+#ifndef BEAST_WS_HANDOFF_SESSIONS
+#if BOOST_VERSION >= BEAST_WS_HANDOFF_BOOST_MIN && BOOST_VERSION / 100 <= BEAST_WS_HANDOFF_BOOST_MAX / 100
+#define BEAST_WS_HANDOFF_SESSIONS 1
+#else
+#define BEAST_WS_HANDOFF_SESSIONS 0
+#endif
+#endif
+
+/// \brief Whether idle sessions go to the next process (see stream_quiet)
+constexpr bool sessions = BEAST_WS_HANDOFF_SESSIONS != 0;
+
+namespace detail {
+
+using stream_type = boost::beast::websocket::stream<boost::asio::ip::tcp::socket>;
+
+#if BEAST_WS_HANDOFF_SESSIONS
+
+static_assert(BOOST_VERSION >= BEAST_WS_HANDOFF_BOOST_MIN
+              && BOOST_VERSION / 100 <= BEAST_WS_HANDOFF_BOOST_MAX / 100,
+              "session handoff reads private websocket stream members, "
+              "validated on Boost 1.70 - 1.74 only");
+
+// The read buffer and the write lock of a stream are private. Access
+// checking does not apply to the arguments of an explicit instantiation,
+// which hands out a pointer to the member holding them
+struct stream_impl{
+    friend auto member(stream_impl);
+};
+
+template<class Tag, class Member, Member pointer>
+struct expose{
+    friend auto member(Tag){
+        return pointer;
+    }
+};
+
+template struct expose<stream_impl, decltype(&stream_type::impl_), &stream_type::impl_>;
+
+#endif // BEAST_WS_HANDOFF_SESSIONS
+
+} // namespace detail
+
+/// \brief Whether the stream holds no bytes read past its last frame and
+/// writes no frame of its own (pong, close)
+/// Only then may its socket go to another process. Always false when
+/// session handoff is off (see sessions).
+inline bool stream_quiet(detail::stream_type & stream){
+#if BEAST_WS_HANDOFF_SESSIONS
+    auto const & impl = stream.*member(detail::stream_impl{});
+    return impl && impl->rd_buf.size() == 0 && !impl->wr_block.is_locked();
+#else
+    boost::ignore_unused(stream);
+    return false;
+#endif
+}
+
+/// \brief What a process receives from its predecessor on start
+/// Connects to the handoff socket of the running process (see
+/// server::accept_handoff) and reads everything it hands over: its
+/// listening sockets and the idle sessions it could detach. Without a
+/// predecessor the inheritance is empty. Descriptors nobody takes are
+/// closed with the inheritance.
+/// Records: "l"              - listening socket
+///          "s <t|b> <path>" - open session, frame type and upgrade target
+class inheritance : private boost::noncopyable{
+
+public:
+
+    struct listener{
+        boost::asio::ip::tcp::endpoint endpoint;
+        int fd;
+    };
+
+    struct session{
+        boost::asio::ip::tcp::endpoint endpoint;
+        int fd;
+        bool text;
+        std::string target;
+    };
+
+private:
+
+    std::vector<listener> listeners_;
+    std::vector<session> sessions_;
+
+    static boost::asio::ip::tcp::endpoint local_endpoint(int fd){
+        boost::asio::ip::tcp::endpoint endpoint;
+        socklen_t size = static_cast<socklen_t>(endpoint.capacity());
+        if(::getsockname(fd, endpoint.data(), &size) == 0)
+            endpoint.resize(size);
+        return endpoint;
+    }
+
+public:
+
+    explicit inheritance(const std::string & path){
+        sockaddr_un address;
+        if(!unix_address(path, address))
+            return;
+
+        int const channel = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(channel < 0)
+            return;
+
+        // nobody to take over from
+        if(::connect(channel, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+                || ::send(channel, &request, 1, MSG_NOSIGNAL) != 1){
+            ::close(channel);
+            return;
+        }
+
+        std::string payload;
+        int fd;
+        boost::system::error_code ec;
+
+        while(receive_record(channel, payload, fd, ec)){
+            if(fd < 0)
+                continue;
+
+            if(payload == "l")
+                listeners_.push_back({local_endpoint(fd), fd});
+            else if(payload.size() > 2 && payload[0] == 's')
+                sessions_.push_back({local_endpoint(fd), fd, payload[2] == 't',
+                                     payload.size() > 4 ? payload.substr(4) : std::string{"/"}});
+            else
+                ::close(fd);
+        }
+
+        if(ec)
+            logging::fail(ec, "handoff");
+
+        ::close(channel);
+    }
+
+    ~inheritance(){
+        for(auto const & l : listeners_)
+            ::close(l.fd);
+        for(auto const & s : sessions_)
+            ::close(s.fd);
+    }
+
+    bool empty() const{
+        return listeners_.empty() && sessions_.empty();
+    }
+
+    /// \brief Listening socket bound to `endpoint`, -1 if none was handed over
+    int take_listener(const boost::asio::ip::tcp::endpoint & endpoint){
+        for(auto it = listeners_.begin(); it != listeners_.end(); ++it)
+            if(it->endpoint == endpoint){
+                auto const fd = it->fd;
+                listeners_.erase(it);
+                return fd;
+            }
+        return -1;
+    }
+
+    /// \brief The sessions handed over, their descriptors belong to the caller
+    std::vector<session> take_sessions(){
+        std::vector<session> sessions;
+        sessions.swap(sessions_);
+        return sessions;
+    }
+
+}; // inheritance class
+
+} // namespace handoff
+
+} // namespace ws
+
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+
+#endif // BEAST_WS_HANDOFF_HPP
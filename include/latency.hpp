@@ -0,0 +1,141 @@
+#ifndef BEAST_WS_LATENCY_HPP
+#define BEAST_WS_LATENCY_HPP
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/core/ignore_unused.hpp>
+#include <boost/core/noncopyable.hpp>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#endif
+
+namespace ws {
+
+/// \brief Socket options of the low latency profile
+struct socket_tuning{
+
+    // TCP_NODELAY, no Nagle delay of small frames
+    bool no_delay = false;
+    // TCP_QUICKACK, set once on accept (Linux). The kernel may go back to
+    // delayed acks when the traffic turns interactive
+    bool quick_ack = false;
+    // SO_BUSY_POLL, the kernel polls the device queue on reads for up to
+    // this long, zero is off (Linux, above net.core.busy_read needs
+    // CAP_NET_ADMIN)
+    std::chrono::microseconds busy_poll{0};
+
+    bool enabled() const{
+        return no_delay || quick_ack || busy_poll.count() > 0;
+    }
+
+};
+
+namespace base {
+
+/// \brief Apply socket_tuning to a connected socket, errors are ignored
+inline void tune_socket(boost::asio::ip::tcp::socket & socket, const socket_tuning & tuning){
+    boost::system::error_code ec;
+
+    if(tuning.no_delay)
+        socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+
+#if defined(__linux__)
+    if(tuning.quick_ack){
+        int const on = 1;
+        ::setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+
+#if defined(SO_BUSY_POLL)
+    if(tuning.busy_poll.count() > 0){
+        int const us = static_cast<int>(tuning.busy_poll.count());
+        ::setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+    }
+#endif
+#endif
+}
+
+/// \brief A thread that spins on io_context::poll() instead of sleeping
+/// in the reactor
+/// It is pinned to one cpu (best kept out of the scheduler with
+/// isolcpus/nohz_full) and runs ready handlers as soon as the reactor
+/// reports them, with no wake-up or context switch. It burns the whole
+/// core. One thread only: several spinning on the same io_context would
+/// contend on its lock on every poll. As the only thread of the context
+/// it never contends for a session strand, whose dispatch runs inline.
+class spin_thread : private boost::noncopyable{
+
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+
+    static void relax(){
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+public:
+
+    ~spin_thread(){
+        stop();
+        join();
+    }
+
+    /// \brief Pin the calling thread, false if not supported or not allowed
+    static bool pin(int cpu){
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+#else
+        boost::ignore_unused(cpu);
+        return false;
+#endif
+    }
+
+    /// \brief Start the thread, once. Nothing else may run the context
+    /// \param Context to poll, e.g. http::base::processor::get().io_service()
+    /// \param Cpu of the thread
+    void start(boost::asio::io_context & ioc, int cpu){
+        if(thread_.joinable())
+            return;
+
+        thread_ = std::thread{[this, &ioc, cpu]{
+            pin(cpu);
+
+            // poll() stops the context once it runs out of work
+            auto const work = boost::asio::make_work_guard(ioc);
+
+            while(!stop_.load(std::memory_order_relaxed) && !ioc.stopped())
+                if(ioc.poll() == 0)
+                    relax();
+        }};
+    }
+
+    /// \brief The thread returns, handlers left are run by whoever runs the context
+    void stop(){
+        stop_ = true;
+    }
+
+    void join(){
+        if(thread_.joinable())
+            thread_.join();
+    }
+
+}; // spin_thread class
+
+} // namespace base
+
+} // namespace ws
+
+#endif // BEAST_WS_LATENCY_HPP
@@ -0,0 +1,632 @@
+#ifndef BEAST_WS_LIMITS_HPP
+#define BEAST_WS_LIMITS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/core/noncopyable.hpp>
+
+namespace ws {
+
+/// \brief Sustained rate and burst of a token bucket
+struct rate_limit{
+
+    // tokens per second, zero is unlimited
+    double rate = 0;
+    // bucket size, zero is one second worth of tokens
+    double burst = 0;
+
+};
+
+/// \brief Process wide budget of session memory
+/// Io buffers are charged through their allocator (ws::multi_buffer).
+/// usage() is a gauge that can be exported as is. What sessions do over
+/// budget is set by session_options.
+/// A thread takes credit from the budget 64 KiB at a time and charges its
+/// allocations against it, so most charges and releases touch no shared
+/// state. usage() counts that credit as used: it runs ahead of the bytes
+/// allocated by at most 128 KiB per thread.
+class memory_budget{
+
+    static constexpr std::size_t credit_size = 64 * 1024;
+
+    // trivially destructible, still readable while the thread locals of an
+    // exiting thread are torn down
+    struct thread_credit{
+        // taken from usage_, not allocated yet
+        std::size_t bytes = 0;
+        bool exiting = false;
+    };
+
+    // gives the credit of a thread back when it exits
+    struct credit_return{
+        ~credit_return(){
+            auto & c = credit();
+            c.exiting = true;
+            get().give_back(c.bytes);
+            c.bytes = 0;
+        }
+    };
+
+    static thread_credit & credit(){
+        thread_local thread_credit value;
+        return value;
+    }
+
+    static void returns_credit(){
+        thread_local credit_return instance;
+        static_cast<void>(instance);
+    }
+
+    std::atomic<std::size_t> usage_{0};
+    std::atomic<std::size_t> peak_{0};
+    std::atomic<std::size_t> limit_{0};
+    std::atomic<std::size_t> sessions_{0};
+
+    // run once usage is back under the limit
+    std::mutex waiters_mutex_;
+    std::vector<std::function<void()>> waiters_;
+    std::atomic<bool> waiting_{false};
+
+    void take(std::size_t bytes){
+        auto const now = usage_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        auto peak = peak_.load(std::memory_order_relaxed);
+        while(now > peak && !peak_.compare_exchange_weak(peak, now, std::memory_order_relaxed))
+            ;
+    }
+
+    void give_back(std::size_t bytes){
+        if(bytes == 0)
+            return;
+
+        // sequentially consistent with when_under, no waiter is missed
+        usage_.fetch_sub(bytes);
+        if(waiting_.load())
+            wake();
+    }
+
+    void wake(){
+        if(exceeded())
+            return;
+
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock{waiters_mutex_};
+            ready.swap(waiters_);
+            waiting_.store(false);
+        }
+
+        for(auto & f : ready)
+            f();
+    }
+
+public:
+
+    // admission counters
+    std::atomic<std::uint64_t> paused_reads{0};
+    std::atomic<std::uint64_t> rejected_upgrades{0};
+    std::atomic<std::uint64_t> closed_sessions{0};
+
+    static memory_budget & get(){
+        static memory_budget instance;
+        return instance;
+    }
+
+    /// \brief Budget in bytes, zero is unlimited
+    void limit(std::size_t bytes){
+        limit_.store(bytes, std::memory_order_relaxed);
+        if(waiting_.load())
+            wake();
+    }
+
+    std::size_t limit() const{
+        return limit_.load(std::memory_order_relaxed);
+    }
+
+    std::size_t usage() const{
+        return usage_.load(std::memory_order_relaxed);
+    }
+
+    std::size_t peak() const{
+        return (std::max)(peak_.load(std::memory_order_relaxed), usage());
+    }
+
+    std::size_t sessions() const{
+        return sessions_.load(std::memory_order_relaxed);
+    }
+
+    bool exceeded() const{
+        auto const l = limit();
+        return l > 0 && usage() > l;
+    }
+
+    /// \brief Average usage of an open session
+    std::size_t share() const{
+        auto const n = sessions();
+        return n > 0 ? usage() / n : usage();
+    }
+
+    void charge(std::size_t bytes){
+        auto & c = credit();
+        if(c.bytes >= bytes){
+            c.bytes -= bytes;
+            return;
+        }
+
+        if(c.exiting)
+            return take(bytes);
+
+        returns_credit();
+
+        auto const needed = bytes - c.bytes;
+        auto const taken = (needed + credit_size - 1) / credit_size * credit_size;
+        take(taken);
+        c.bytes += taken - bytes;
+    }
+
+    void release(std::size_t bytes){
+        auto & c = credit();
+        if(c.exiting)
+            return give_back(bytes);
+
+        returns_credit();
+
+        c.bytes += bytes;
+
+        // credit counts as used, paused readers wait for it
+        if(waiting_.load()){
+            give_back(c.bytes);
+            c.bytes = 0;
+        }
+        else if(c.bytes > 2 * credit_size){
+            give_back(c.bytes - credit_size);
+            c.bytes = credit_size;
+        }
+    }
+
+    /// \brief Run `f` once usage is under the limit, at once if it is
+    /// It runs on the thread that releases the memory, so it should only
+    /// post the work to where it belongs. Credit other threads hold until
+    /// they release memory again still counts, callers should look again
+    /// after a while.
+    void when_under(std::function<void()> f){
+        // the credit of this thread first
+        auto & c = credit();
+        if(c.bytes > 0 && !c.exiting){
+            usage_.fetch_sub(c.bytes);
+            c.bytes = 0;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{waiters_mutex_};
+            waiting_.store(true);
+
+            auto const l = limit();
+            if(l > 0 && usage_.load() > l){
+                waiters_.push_back(std::move(f));
+                return;
+            }
+
+            if(waiters_.empty())
+                waiting_.store(false);
+        }
+
+        f();
+    }
+
+    void open_session(){
+        sessions_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void close_session(){
+        sessions_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+}; // memory_budget class
+
+namespace base {
+
+/// \brief Token bucket that may run into debt
+/// The size of a WebSocket message is only known once it has been read,
+/// so it is charged afterwards and the next read waits until the debt is
+/// paid off.
+class token_bucket{
+
+    using clock = std::chrono::steady_clock;
+
+    double rate_ = 0;
+    double burst_ = 0;
+    double tokens_ = 0;
+    clock::time_point last_;
+
+    void refill(clock::time_point now){
+        if(now <= last_)
+            return;
+
+        auto const elapsed = std::chrono::duration<double>(now - last_).count();
+        tokens_ = (std::min)(burst_, tokens_ + elapsed * rate_);
+        last_ = now;
+    }
+
+public:
+
+    token_bucket()
+    {}
+
+    explicit token_bucket(const rate_limit & limit)
+        : rate_{limit.rate},
+          burst_{limit.burst > 0 ? limit.burst : limit.rate},
+          tokens_{burst_},
+          last_{clock::now()}
+    {}
+
+    bool enabled() const{
+        return rate_ > 0;
+    }
+
+    void consume(double tokens, clock::time_point now = clock::now()){
+        if(!enabled())
+            return;
+
+        refill(now);
+        tokens_ -= tokens;
+    }
+
+    /// \brief Time until the bucket is out of debt
+    clock::duration wait(clock::time_point now = clock::now()){
+        if(!enabled())
+            return clock::duration::zero();
+
+        refill(now);
+        if(tokens_ >= 0)
+            return clock::duration::zero();
+
+        return std::chrono::duration_cast<clock::duration>(
+                    std::chrono::duration<double>(-tokens_ / rate_));
+    }
+
+}; // token_bucket class
+
+/// \brief Connection counts by remote address
+/// Open addressing over 16 byte keys (IPv4 is mapped), an address is
+/// removed with its last connection.
+class address_table{
+
+public:
+
+    using key_type = std::array<unsigned char, 16>;
+
+private:
+
+    struct slot{
+        key_type key;
+        std::uint32_t count = 0;
+    };
+
+    std::vector<slot> slots_;
+    std::size_t size_ = 0;
+
+    std::size_t home(const key_type & key) const{
+        // FNV-1a
+        std::uint64_t h = 14695981039346656037ULL;
+        for(auto c : key){
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return static_cast<std::size_t>(h) & (slots_.size() - 1);
+    }
+
+    std::size_t locate(const key_type & key) const{
+        auto const mask = slots_.size() - 1;
+        auto pos = home(key);
+        while(slots_[pos].count != 0 && slots_[pos].key != key)
+            pos = (pos + 1) & mask;
+        return pos;
+    }
+
+    void grow(){
+        std::vector<slot> old(slots_.empty() ? 64 : slots_.size() * 2);
+        old.swap(slots_);
+
+        for(auto const & s : old)
+            if(s.count != 0)
+                slots_[locate(s.key)] = s;
+    }
+
+public:
+
+    static key_type key(const boost::asio::ip::address & address){
+        return address.is_v4() ? boost::asio::ip::address_v6::v4_mapped(address.to_v4()).to_bytes()
+                               : address.to_v6().to_bytes();
+    }
+
+    std::uint32_t count(const key_type & key) const{
+        if(size_ == 0)
+            return 0;
+        return slots_[locate(key)].count;
+    }
+
+    void increment(const key_type & key){
+        if((size_ + 1) * 2 > slots_.size())
+            grow();
+
+        auto & s = slots_[locate(key)];
+        if(s.count == 0){
+            s.key = key;
+            ++size_;
+        }
+        ++s.count;
+    }
+
+    void decrement(const key_type & key){
+        if(size_ == 0)
+            return;
+
+        auto const mask = slots_.size() - 1;
+        auto i = locate(key);
+        if(slots_[i].count == 0 || --slots_[i].count != 0)
+            return;
+
+        --size_;
+
+        for(auto j = (i + 1) & mask; slots_[j].count != 0; j = (j + 1) & mask){
+            if(((j - home(slots_[j].key)) & mask) >= ((j - i) & mask)){
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+
+        slots_[i] = slot{};
+    }
+
+}; // address_table class
+
+} // namespace base
+
+/// \brief Admission of WebSocket upgrades (see server_impl::admission)
+struct handshake_options{
+
+    // Upgrades started per second, zero is unlimited
+    rate_limit handshakes;
+    // Upgrades waiting for the rate limit, more are rejected
+    std::size_t max_pending = 1024;
+    // Concurrent connections per remote address, zero is unlimited
+    std::size_t max_per_address = 0;
+    // Reject with a TCP reset instead of an HTTP 503
+    bool abortive_reject = false;
+
+    bool enabled() const{
+        return handshakes.rate > 0 || max_per_address > 0;
+    }
+
+};
+
+namespace base {
+
+/// \brief Admission control of upgrades
+/// An upgrade gets a ticket at once, after waiting in a bounded queue
+/// for the handshake rate, or no ticket (rejected). The ticket counts the
+/// connection against its address until it is destroyed with the session.
+class handshake_gate : private boost::noncopyable{
+
+public:
+
+    class ticket{
+
+        handshake_gate* gate_ = nullptr;
+        address_table::key_type key_;
+
+    public:
+
+        ticket()
+        {}
+
+        ticket(handshake_gate* gate, const address_table::key_type & key)
+            : gate_{gate}, key_(key)
+        {}
+
+        ticket(ticket&& other) noexcept
+            : gate_{other.gate_}, key_(other.key_)
+        {
+            other.gate_ = nullptr;
+        }
+
+        ticket& operator=(ticket&& other) noexcept{
+            if(this != &other){
+                release();
+                gate_ = other.gate_;
+                key_ = other.key_;
+                other.gate_ = nullptr;
+            }
+            return *this;
+        }
+
+        ~ticket(){
+            release();
+        }
+
+        explicit operator bool() const{
+            return gate_ != nullptr;
+        }
+
+        void release(){
+            if(gate_ != nullptr)
+                gate_->leave(key_);
+            gate_ = nullptr;
+        }
+
+    }; // ticket class
+
+    // the ticket, and whether the upgrade waited in the queue
+    using handler_type = std::function<void(ticket, bool)>;
+
+    struct counters{
+        std::atomic<std::uint64_t> admitted{0};
+        std::atomic<std::uint64_t> queued{0};
+        std::atomic<std::uint64_t> rejected{0};
+    };
+
+private:
+
+    struct pending{
+        address_table::key_type key;
+        handler_type handler;
+    };
+
+    const handshake_options & options_;
+    std::mutex mutex_;
+    boost::asio::steady_timer timer_;
+    bool armed_ = false;
+    bool configured_ = false;
+    token_bucket bucket_;
+    address_table addresses_;
+    std::deque<pending> pending_;
+    counters stats_;
+
+    void leave(const address_table::key_type & key){
+        std::lock_guard<std::mutex> lock{mutex_};
+        addresses_.decrement(key);
+    }
+
+    // under the lock
+    void arm(){
+        if(armed_ || pending_.empty())
+            return;
+
+        armed_ = true;
+        timer_.expires_after((std::max)(bucket_.wait(), std::chrono::steady_clock::duration{std::chrono::milliseconds(1)}));
+        timer_.async_wait([this](const boost::system::error_code & ec){
+            // only the destructor cancels the timer, the gate is gone
+            if(ec == boost::asio::error::operation_aborted)
+                return;
+
+            on_timer(ec);
+        });
+    }
+
+    void on_timer(const boost::system::error_code & ec){
+        if(ec){
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                armed_ = false;
+            }
+            return flush();
+        }
+
+        std::vector<pending> ready;
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            armed_ = false;
+
+            while(!pending_.empty() && bucket_.wait() == std::chrono::steady_clock::duration::zero()){
+                bucket_.consume(1);
+                ready.push_back(std::move(pending_.front()));
+                pending_.pop_front();
+            }
+
+            arm();
+        }
+
+        for(auto & p : ready){
+            stats_.admitted.fetch_add(1, std::memory_order_relaxed);
+            p.handler(ticket{this, p.key}, true);
+        }
+    }
+
+public:
+
+    handshake_gate(boost::asio::io_context & ioc, const handshake_options & options)
+        : options_{options},
+          timer_{ioc}
+    {}
+
+    ~handshake_gate(){
+        flush();
+        timer_.cancel();
+    }
+
+    /// \brief Reject every queued upgrade
+    /// Their handlers run on the calling thread with an empty ticket.
+    void flush(){
+        std::deque<pending> dropped;
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            dropped.swap(pending_);
+            for(auto const & p : dropped)
+                addresses_.decrement(p.key);
+        }
+
+        for(auto & p : dropped){
+            stats_.rejected.fetch_add(1, std::memory_order_relaxed);
+            p.handler(ticket{}, true);
+        }
+    }
+
+    counters & stats(){
+        return stats_;
+    }
+
+    /// \brief Ask to start an upgrade from `address`
+    /// \param Remote address
+    /// \param Called with the ticket, or an empty one if rejected, and
+    /// whether the upgrade had to wait. Runs inline unless it waited, then
+    /// on the timer of the gate
+    void enter(const boost::asio::ip::address & address, handler_type handler){
+        auto const key = address_table::key(address);
+        bool admitted = false;
+        bool rejected = false;
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+
+            if(!configured_){
+                bucket_ = token_bucket{options_.handshakes};
+                configured_ = true;
+            }
+
+            if(options_.max_per_address > 0 && addresses_.count(key) >= options_.max_per_address)
+                rejected = true;
+            else if(bucket_.wait() == std::chrono::steady_clock::duration::zero() && pending_.empty()){
+                bucket_.consume(1);
+                addresses_.increment(key);
+                admitted = true;
+            }
+            else if(pending_.size() < options_.max_pending){
+                addresses_.increment(key);
+                pending_.push_back({key, std::move(handler)});
+                arm();
+            }
+            else
+                rejected = true;
+        }
+
+        if(admitted){
+            stats_.admitted.fetch_add(1, std::memory_order_relaxed);
+            handler(ticket{this, key}, false);
+        }
+        else if(rejected){
+            stats_.rejected.fetch_add(1, std::memory_order_relaxed);
+            handler(ticket{}, false);
+        }
+        else
+            stats_.queued.fetch_add(1, std::memory_order_relaxed);
+    }
+
+}; // handshake_gate class
+
+} // namespace base
+
+} // namespace ws
+
+#endif // BEAST_WS_LIMITS_HPP
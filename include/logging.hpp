@@ -0,0 +1,368 @@
+#ifndef BEAST_WS_LOGGING_HPP
+#define BEAST_WS_LOGGING_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <boost/core/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+
+// Least level compiled in: 0 debug, 1 info, 2 warning, 3 error, 4 none.
+// Calls below it compile to nothing
+#ifndef BEAST_WS_LOG_LEVEL
+#define BEAST_WS_LOG_LEVEL 1
+#endif
+
+namespace ws {
+
+/// \brief Diagnostics of the library, off the io threads
+/// A call only stores a small record in a ring of its thread: no lock, no
+/// allocation (but for the first record of a thread), no formatting. A
+/// writer thread formats the records and hands the lines to the sink. A
+/// record whose ring is full is dropped and counted, the caller never
+/// waits. Each category (the `what` of a record) may log `rate()` records
+/// per second, the rest is counted and reported with its next line.
+namespace logging {
+
+enum class level : int{
+    debug,
+    info,
+    warning,
+    error
+};
+
+constexpr bool compiled(level l){
+    return static_cast<int>(l) >= BEAST_WS_LOG_LEVEL;
+}
+
+inline const char* to_string(level l){
+    switch(l){
+    case level::debug: return "debug";
+    case level::info: return "info";
+    case level::warning: return "warning";
+    default: return "error";
+    }
+}
+
+/// \brief Logging counters, summed over all threads
+struct counters{
+    std::atomic<std::uint64_t> written{0};
+    // over the rate of their category
+    std::atomic<std::uint64_t> suppressed{0};
+    // the ring of their thread was full
+    std::atomic<std::uint64_t> dropped{0};
+};
+
+inline counters & stats(){
+    static counters instance;
+    return instance;
+}
+
+namespace detail {
+
+struct record{
+    std::chrono::system_clock::time_point time;
+    level severity;
+    // a string literal, read later by the writer
+    const char* what;
+    int value;
+    const boost::system::error_category* category;
+    // records of the category suppressed since the last one written
+    std::uint64_t suppressed;
+};
+
+/// \brief Records of one thread on their way to the writer
+/// One producer (the owning thread) and one consumer (the writer).
+class ring : private boost::noncopyable{
+
+    static constexpr std::size_t capacity = 512;
+
+    std::array<record, capacity> records_;
+    std::atomic<std::size_t> head_{0};
+    std::atomic<std::size_t> tail_{0};
+
+public:
+
+    // a thread writes to it; rings of finished threads are taken over
+    std::atomic<bool> owned{true};
+    ring* next = nullptr;
+
+    bool push(const record & r){
+        auto const head = head_.load(std::memory_order_relaxed);
+        if(head - tail_.load(std::memory_order_acquire) == capacity)
+            return false;
+
+        records_[head % capacity] = r;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    template<class F>
+    void drain(F&& f){
+        auto tail = tail_.load(std::memory_order_relaxed);
+        auto const head = head_.load(std::memory_order_acquire);
+
+        for(; tail != head; ++tail)
+            f(records_[tail % capacity]);
+
+        tail_.store(tail, std::memory_order_release);
+    }
+
+}; // ring class
+
+/// \brief Records per second of a category
+struct category{
+    // hash of the what string, zero while free
+    std::atomic<std::uint64_t> key{0};
+    std::atomic<std::int64_t> second{0};
+    std::atomic<std::uint32_t> count{0};
+    std::atomic<std::uint64_t> suppressed{0};
+};
+
+class backend : private boost::noncopyable{
+
+    static constexpr std::size_t category_count = 64;
+
+    std::atomic<ring*> rings_{nullptr};
+    std::array<category, category_count> categories_;
+    std::atomic<std::uint32_t> rate_{10};
+
+    std::once_flag started_;
+    // held by whoever drains the rings
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::function<void(level, const std::string&)> sink_;
+
+    backend() = default;
+
+    static std::uint64_t hash(const char* what){
+        std::uint64_t h = 14695981039346656037ULL;
+        for(; *what != '\0'; ++what)
+            h = (h ^ static_cast<unsigned char>(*what)) * 1099511628211ULL;
+        return h == 0 ? 1 : h;
+    }
+
+    category* find(const char* what){
+        auto const key = hash(what);
+        auto index = static_cast<std::size_t>(key) % category_count;
+
+        for(std::size_t i = 0; i < category_count; ++i, index = (index + 1) % category_count){
+            auto & c = categories_[index];
+            auto k = c.key.load(std::memory_order_acquire);
+            if(k == key)
+                return &c;
+            if(k == 0 && (c.key.compare_exchange_strong(k, key) || k == key))
+                return &c;
+        }
+
+        // more categories than slots, those go unlimited
+        return nullptr;
+    }
+
+    void run(){
+        std::unique_lock<std::mutex> lock{mutex_};
+        for(;;){
+            wake_.wait_for(lock, std::chrono::milliseconds(20));
+            drain();
+        }
+    }
+
+    // with mutex_ held
+    void drain(){
+        for(auto r = rings_.load(std::memory_order_acquire); r != nullptr; r = r->next)
+            r->drain([this](const record & rec){ write(rec); });
+    }
+
+    void write(const record & r){
+        auto const t = std::chrono::system_clock::to_time_t(r.time);
+        auto const ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    r.time.time_since_epoch()).count() % 1000;
+
+        std::tm tm{};
+        ::gmtime_r(&t, &tm);
+
+        char stamp[32];
+        auto const n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        std::snprintf(stamp + n, sizeof(stamp) - n, ".%03d", static_cast<int>(ms));
+
+        std::string line = stamp;
+        line += ' ';
+        line += to_string(r.severity);
+        line += ' ';
+        line += r.what;
+        if(r.category != nullptr){
+            line += ": ";
+            line += r.category->message(r.value);
+        }
+        if(r.suppressed > 0)
+            line += " (" + std::to_string(r.suppressed) + " more suppressed)";
+
+        if(sink_)
+            sink_(r.severity, line);
+        else
+            std::cerr << line << std::endl;
+
+        stats().written.fetch_add(1, std::memory_order_relaxed);
+    }
+
+public:
+
+    static backend & get(){
+        // never destroyed, io threads may log during exit
+        static backend* instance = new backend;
+        return *instance;
+    }
+
+    /// \brief A ring for a thread that has none: one left by a finished
+    /// thread, or a new one
+    ring* acquire(){
+        for(auto r = rings_.load(std::memory_order_acquire); r != nullptr; r = r->next){
+            bool owned = false;
+            if(r->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+                return r;
+        }
+
+        auto const r = new ring;
+        r->next = rings_.load(std::memory_order_relaxed);
+        while(!rings_.compare_exchange_weak(r->next, r, std::memory_order_release))
+            ;
+
+        std::call_once(started_, []{
+            std::thread{[]{ get().run(); }}.detach();
+            std::atexit([]{ get().flush(); });
+        });
+
+        return r;
+    }
+
+    /// \brief Whether a record of this category may go out now
+    /// \param Set to the records suppressed since the last one
+    bool admit(const char* what, std::chrono::system_clock::time_point now, std::uint64_t & suppressed){
+        suppressed = 0;
+
+        auto const rate = rate_.load(std::memory_order_relaxed);
+        if(rate == 0)
+            return true;
+
+        auto const c = find(what);
+        if(c == nullptr)
+            return true;
+
+        auto const second = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+        auto last = c->second.load(std::memory_order_relaxed);
+        if(last != second && c->second.compare_exchange_strong(last, second, std::memory_order_relaxed))
+            c->count.store(0, std::memory_order_relaxed);
+
+        if(c->count.fetch_add(1, std::memory_order_relaxed) < rate){
+            suppressed = c->suppressed.exchange(0, std::memory_order_relaxed);
+            return true;
+        }
+
+        c->suppressed.fetch_add(1, std::memory_order_relaxed);
+        stats().suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void rate(std::uint32_t per_second){
+        rate_.store(per_second, std::memory_order_relaxed);
+    }
+
+    void sink(std::function<void(level, const std::string&)> f){
+        std::lock_guard<std::mutex> lock{mutex_};
+        sink_ = std::move(f);
+    }
+
+    void flush(){
+        std::lock_guard<std::mutex> lock{mutex_};
+        drain();
+    }
+
+}; // backend class
+
+struct thread_ring{
+    ring* r = nullptr;
+
+    ~thread_ring(){
+        if(r != nullptr)
+            r->owned.store(false, std::memory_order_release);
+    }
+};
+
+inline ring & local(){
+    thread_local thread_ring instance;
+    if(instance.r == nullptr)
+        instance.r = backend::get().acquire();
+    return *instance.r;
+}
+
+template<level L>
+void put(const char* what, const boost::system::error_code* ec){
+    if(!compiled(L))
+        return;
+
+    auto const now = std::chrono::system_clock::now();
+
+    std::uint64_t suppressed;
+    if(!backend::get().admit(what, now, suppressed))
+        return;
+
+    record const r{now, L, what, ec != nullptr ? ec->value() : 0,
+                ec != nullptr ? &ec->category() : nullptr, suppressed};
+
+    if(!local().push(r))
+        stats().dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+/// \brief A failed operation, at error level
+/// \param Error
+/// \param What failed, a string literal: the writer reads it later
+inline void fail(const boost::system::error_code & ec, const char* what){
+    detail::put<level::error>(what, &ec);
+}
+
+inline void warning(const boost::system::error_code & ec, const char* what){
+    detail::put<level::warning>(what, &ec);
+}
+
+/// \brief An event, a string literal
+inline void info(const char* what){
+    detail::put<level::info>(what, nullptr);
+}
+
+inline void debug(const char* what){
+    detail::put<level::debug>(what, nullptr);
+}
+
+/// \brief Records per second each category may log, zero for no limit (default 10)
+inline void rate(std::uint32_t per_second){
+    detail::backend::get().rate(per_second);
+}
+
+/// \brief Where the writer puts its lines, std::cerr by default
+inline void sink(std::function<void(level, const std::string&)> f){
+    detail::backend::get().sink(std::move(f));
+}
+
+/// \brief Write out the records made so far, in the calling thread
+inline void flush(){
+    detail::backend::get().flush();
+}
+
+} // namespace logging
+
+} // namespace ws
+
+#endif // BEAST_WS_LOGGING_HPP
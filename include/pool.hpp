@@ -0,0 +1,291 @@
+#ifndef BEAST_WS_POOL_HPP
+#define BEAST_WS_POOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include <boost/beast/core/multi_buffer.hpp>
+
+#include "limits.hpp"
+
+namespace ws {
+
+namespace base {
+
+/// \brief Per-thread recycling of memory blocks
+/// Blocks are rounded up to a power of two (64 bytes .. 64 KiB) and kept on
+/// a free list of the thread that releases them, up to a configurable
+/// number of cached bytes per thread. Larger blocks, and blocks beyond the
+/// limit, go straight to the global heap.
+class pool{
+
+    static constexpr std::size_t min_shift = 6;
+    static constexpr std::size_t max_shift = 16;
+    static constexpr std::size_t class_count = max_shift - min_shift + 1;
+
+    struct node{
+        node* next;
+    };
+
+    struct free_list{
+        node* head = nullptr;
+    };
+
+    /// Counters of one thread. Only their thread writes them, so an update
+    /// is a plain load and store; stats() sums them. Blocks of finished
+    /// threads are taken over by new ones, so the sums stay right.
+    struct thread_counters{
+        std::atomic<std::uint64_t> hits{0};
+        std::atomic<std::uint64_t> misses{0};
+        std::atomic<std::uint64_t> recycled{0};
+        std::atomic<std::uint64_t> dropped{0};
+        std::atomic<bool> owned{true};
+        thread_counters* next = nullptr;
+
+        static void add(std::atomic<std::uint64_t> & counter){
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    };
+
+    static std::atomic<thread_counters*> & counters_list(){
+        static std::atomic<thread_counters*> head{nullptr};
+        return head;
+    }
+
+    static thread_counters* acquire_counters(){
+        auto & head = counters_list();
+        for(auto c = head.load(std::memory_order_acquire); c != nullptr; c = c->next){
+            bool owned = false;
+            if(c->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+                return c;
+        }
+
+        // never freed, stats() may read it after its thread is gone
+        auto const c = new thread_counters;
+        c->next = head.load(std::memory_order_relaxed);
+        while(!head.compare_exchange_weak(c->next, c, std::memory_order_release))
+            ;
+        return c;
+    }
+
+    // Releases after the cache of the thread is destroyed (other thread
+    // local destructors) go to the global heap, counted here
+    static std::atomic<std::uint64_t> & late_drops(){
+        static std::atomic<std::uint64_t> value{0};
+        return value;
+    }
+
+    // Trivially destructible, so it can still be read while the thread
+    // locals are torn down
+    static bool & exiting(){
+        thread_local bool value = false;
+        return value;
+    }
+
+    struct thread_cache{
+        free_list lists[class_count];
+        std::size_t cached_bytes = 0;
+        thread_counters* counters = acquire_counters();
+
+        ~thread_cache(){
+            exiting() = true;
+            for(auto & list : lists)
+                while(list.head != nullptr){
+                    auto const n = list.head;
+                    list.head = n->next;
+                    ::operator delete(n);
+                }
+            counters->owned.store(false, std::memory_order_release);
+        }
+    };
+
+    static thread_cache & cache(){
+        thread_local thread_cache instance;
+        return instance;
+    }
+
+    static std::size_t size_class(std::size_t size){
+        std::size_t c = 0;
+        while((std::size_t{1} << (min_shift + c)) < size)
+            ++c;
+        return c;
+    }
+
+    static std::atomic<std::size_t> & limit_storage(){
+        static std::atomic<std::size_t> value{4 << 20};
+        return value;
+    }
+
+public:
+
+    /// \brief Pool counters, summed over all threads
+    struct counters{
+        std::uint64_t hits = 0;     // served from a free list
+        std::uint64_t misses = 0;   // served from the global heap
+        std::uint64_t recycled = 0; // released to a free list
+        std::uint64_t dropped = 0;  // released to the global heap (limit reached)
+    };
+
+    /// \brief A sum of the per-thread counters, each one read on its own
+    static counters stats(){
+        counters sum;
+        for(auto c = counters_list().load(std::memory_order_acquire); c != nullptr; c = c->next){
+            sum.hits += c->hits.load(std::memory_order_relaxed);
+            sum.misses += c->misses.load(std::memory_order_relaxed);
+            sum.recycled += c->recycled.load(std::memory_order_relaxed);
+            sum.dropped += c->dropped.load(std::memory_order_relaxed);
+        }
+        sum.dropped += late_drops().load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    /// \brief Maximum bytes kept on the free lists of each thread (default 4 MiB)
+    static void limit(std::size_t bytes_per_thread){
+        limit_storage().store(bytes_per_thread, std::memory_order_relaxed);
+    }
+
+    static std::size_t limit(){
+        return limit_storage().load(std::memory_order_relaxed);
+    }
+
+    static void* allocate(std::size_t size){
+        auto const large = size > (std::size_t{1} << max_shift);
+        auto const c = large ? 0 : size_class(size);
+
+        // a whole block, another thread may put it on its free list
+        if(exiting())
+            return ::operator new(large ? size : std::size_t{1} << (min_shift + c));
+
+        auto & tc = cache();
+
+        if(large){
+            thread_counters::add(tc.counters->misses);
+            return ::operator new(size);
+        }
+
+        auto & list = tc.lists[c];
+
+        if(list.head != nullptr){
+            auto const n = list.head;
+            list.head = n->next;
+            tc.cached_bytes -= std::size_t{1} << (min_shift + c);
+            thread_counters::add(tc.counters->hits);
+            return n;
+        }
+
+        thread_counters::add(tc.counters->misses);
+        return ::operator new(std::size_t{1} << (min_shift + c));
+    }
+
+    static void deallocate(void* p, std::size_t size) noexcept{
+        if(size > (std::size_t{1} << max_shift)){
+            ::operator delete(p);
+            return;
+        }
+
+        if(exiting()){
+            late_drops().fetch_add(1, std::memory_order_relaxed);
+            ::operator delete(p);
+            return;
+        }
+
+        auto const c = size_class(size);
+        auto const block = std::size_t{1} << (min_shift + c);
+        auto & tc = cache();
+
+        if(tc.cached_bytes + block > limit()){
+            thread_counters::add(tc.counters->dropped);
+            ::operator delete(p);
+            return;
+        }
+
+        auto const n = static_cast<node*>(p);
+        n->next = tc.lists[c].head;
+        tc.lists[c].head = n;
+        tc.cached_bytes += block;
+        thread_counters::add(tc.counters->recycled);
+    }
+
+}; // pool class
+
+/// \brief Standard allocator on top of the pool
+template<class T>
+class pool_allocator{
+
+public:
+
+    using value_type = T;
+
+    template<class U>
+    struct rebind{
+        using other = pool_allocator<U>;
+    };
+
+    pool_allocator() noexcept
+    {}
+
+    template<class U>
+    pool_allocator(const pool_allocator<U>&) noexcept
+    {}
+
+    T* allocate(std::size_t n){
+        return static_cast<T*>(pool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept{
+        pool::deallocate(p, n * sizeof(T));
+    }
+
+    template<class U>
+    bool operator==(const pool_allocator<U>&) const noexcept{
+        return true;
+    }
+
+    template<class U>
+    bool operator!=(const pool_allocator<U>&) const noexcept{
+        return false;
+    }
+
+}; // pool_allocator class
+
+/// \brief Pool allocator charging memory_budget
+template<class T>
+class buffer_allocator : public pool_allocator<T>{
+
+public:
+
+    template<class U>
+    struct rebind{
+        using other = buffer_allocator<U>;
+    };
+
+    buffer_allocator() noexcept
+    {}
+
+    template<class U>
+    buffer_allocator(const buffer_allocator<U>&) noexcept
+    {}
+
+    T* allocate(std::size_t n){
+        memory_budget::get().charge(n * sizeof(T));
+        return pool_allocator<T>::allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept{
+        pool_allocator<T>::deallocate(p, n);
+        memory_budget::get().release(n * sizeof(T));
+    }
+
+}; // buffer_allocator class
+
+} // namespace base
+
+/// Session io buffer, its blocks are recycled through base::pool and
+/// charged to memory_budget
+using multi_buffer = boost::beast::basic_multi_buffer<base::buffer_allocator<char>>;
+
+} // namespace ws
+
+#endif // BEAST_WS_POOL_HPP
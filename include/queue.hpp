@@ -0,0 +1,533 @@
+#ifndef BEAST_WS_QUEUE_HPP
+#define BEAST_WS_QUEUE_HPP
+
+#include "pool.hpp"
+#include "sendfile.hpp"
+#include "shared_message.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include <boost/beast/core/buffers_suffix.hpp>
+#include <boost/beast/websocket.hpp>
+#include <boost/core/noncopyable.hpp>
+
+namespace ws {
+
+namespace base {
+
+/// \brief Queued messages by conflation key
+/// Open addressing with linear probing and backward shift deletion, empty
+/// until the first keyed message.
+template<class Message>
+class conflation_index{
+
+    struct slot{
+        std::uint64_t key;
+        Message* message = nullptr;
+    };
+
+    std::vector<slot> slots_;
+    std::size_t size_ = 0;
+
+    std::size_t home(std::uint64_t key) const{
+        return static_cast<std::size_t>(key * 11400714819323198485ULL) & (slots_.size() - 1);
+    }
+
+    std::size_t locate(std::uint64_t key) const{
+        auto const mask = slots_.size() - 1;
+        auto pos = home(key);
+        while(slots_[pos].message != nullptr && slots_[pos].key != key)
+            pos = (pos + 1) & mask;
+        return pos;
+    }
+
+    void grow(){
+        std::vector<slot> old(slots_.empty() ? 16 : slots_.size() * 2);
+        old.swap(slots_);
+
+        for(auto const & s : old)
+            if(s.message != nullptr)
+                slots_[locate(s.key)] = s;
+    }
+
+public:
+
+    Message* find(std::uint64_t key) const{
+        if(size_ == 0)
+            return nullptr;
+        return slots_[locate(key)].message;
+    }
+
+    void insert(std::uint64_t key, Message* message){
+        if((size_ + 1) * 2 > slots_.size())
+            grow();
+
+        slots_[locate(key)] = {key, message};
+        ++size_;
+    }
+
+    void erase(std::uint64_t key){
+        if(size_ == 0)
+            return;
+
+        auto const mask = slots_.size() - 1;
+        auto i = locate(key);
+        if(slots_[i].message == nullptr)
+            return;
+
+        --size_;
+
+        for(auto j = (i + 1) & mask; slots_[j].message != nullptr; j = (j + 1) & mask){
+            if(((j - home(slots_[j].key)) & mask) >= ((j - i) & mask)){
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+
+        slots_[i] = slot{};
+    }
+
+}; // conflation_index class
+
+/// \brief Outbound path of a session
+/// Control frames (ping, pong, close) are served first. Data messages are
+/// queued in up to max_lanes priority classes and served by deficit round
+/// robin over their byte sizes, each lane weighted by its share. Data
+/// frames of different messages cannot interleave, so the class of the
+/// next message is only chosen once the current one is complete; control
+/// frames can go out between its fragments.
+/// Keyed messages are conflated: a newer message replaces the queued one
+/// with the same key in place, so a lagging peer gets the latest value of
+/// each key at the position of the first pending one.
+/// A message may also be part of a file, read into its buffer a chunk at
+/// a time (filled) or written by a file_writer (release_file), or a payload
+/// shared with other queues, of which it only holds a reference.
+/// An empty queue holds no heap memory, messages are pooled nodes.
+template<class Buffer>
+class outbound_queue : private boost::noncopyable{
+
+public:
+
+    static constexpr std::size_t max_lanes = 4;
+
+    struct message{
+        Buffer data;
+        // frame type at the time the message was queued
+        bool text;
+        // a first frame has been written
+        bool started;
+        std::size_t lane;
+        std::chrono::steady_clock::time_point queued_at;
+        // conflation key, if keyed
+        bool keyed;
+        std::uint64_t key;
+        message* next;
+        // file part not yet read into data, if any
+        file_range file;
+        // shared payload instead of data, written from shared_offset on
+        basic_shared_message<Buffer> shared;
+        std::size_t shared_offset;
+
+        /// \brief Unwritten bytes in memory
+        std::size_t buffered() const{
+            return shared ? shared.size() - shared_offset : data.size();
+        }
+
+        boost::beast::buffers_suffix<typename Buffer::const_buffers_type> pending() const{
+            boost::beast::buffers_suffix<typename Buffer::const_buffers_type> rest{
+                shared ? shared.data() : data.data()};
+            rest.consume(shared_offset);
+            return rest;
+        }
+
+        std::uint64_t size() const{
+            return buffered() + file.length;
+        }
+    };
+
+    struct control{
+        boost::beast::websocket::frame_type kind;
+        boost::beast::websocket::ping_data payload;
+    };
+
+private:
+
+    struct lane{
+        message* head = nullptr;
+        message* tail = nullptr;
+        std::size_t deficit = 0;
+        std::size_t quantum = 0;
+    };
+
+    std::array<lane, max_lanes> lanes_;
+    std::size_t lane_count_ = 1;
+    std::size_t next_lane_ = 0;
+
+    // message being written, taken off its lane
+    message* current_ = nullptr;
+
+    std::size_t size_ = 0;
+    std::size_t bytes_ = 0;
+    // unread file parts, counted in bytes_
+    std::size_t file_bytes_ = 0;
+
+    conflation_index<message> keys_;
+
+    std::vector<control> controls_;
+    bool close_ = false;
+    boost::beast::websocket::close_reason close_reason_;
+
+    // the message leaves its lane
+    void unlink(message* m){
+        if(m->keyed)
+            keys_.erase(m->key);
+    }
+
+    static void destroy(message* m){
+        m->file.close();
+        m->~message();
+        pool::deallocate(m, sizeof(message));
+    }
+
+    void enqueue(Buffer&& data, bool text, std::size_t lane_index, bool keyed, std::uint64_t key,
+                 file_range&& file = {}, const basic_shared_message<Buffer> & shared = {}){
+        if(close_){
+            file.close();
+            return;
+        }
+
+        auto const l = lane_index < lane_count_ ? lane_index : lane_count_ - 1;
+
+        auto const m = new (pool::allocate(sizeof(message)))
+                message{std::move(data), text, false, l, std::chrono::steady_clock::now(), keyed, key, nullptr, file, shared, 0};
+
+        if(keyed)
+            keys_.insert(key, m);
+
+        auto & ln = lanes_[l];
+        if(ln.tail != nullptr)
+            ln.tail->next = m;
+        else
+            ln.head = m;
+        ln.tail = m;
+
+        ++size_;
+        bytes_ += m->size();
+        file_bytes_ += m->file.length;
+    }
+
+    // Credits at once the rounds in which no lane could send, a message
+    // much larger than a quantum would otherwise take a turn through all
+    // lanes per quantum. Every waiting lane gets the rounds the first of
+    // them needs to send its head, as each of those rounds would give it.
+    void skip_rounds(){
+        std::size_t rounds = 0;
+
+        for(std::size_t i = 0; i < lane_count_; ++i){
+            auto const & ln = lanes_[i];
+            if(ln.head == nullptr)
+                continue;
+
+            auto const size = static_cast<std::size_t>(ln.head->size());
+            if(size <= ln.deficit)
+                return;
+
+            auto const need = (size - ln.deficit + ln.quantum - 1) / ln.quantum;
+            if(rounds == 0 || need < rounds)
+                rounds = need;
+        }
+
+        for(std::size_t i = 0; i < lane_count_; ++i){
+            auto & ln = lanes_[i];
+            if(ln.head != nullptr)
+                ln.deficit += rounds * ln.quantum;
+        }
+    }
+
+public:
+
+    outbound_queue(){
+        lanes_[0].quantum = 64 * 1024;
+    }
+
+    ~outbound_queue(){
+        clear();
+        if(current_ != nullptr)
+            destroy(current_);
+    }
+
+    /// \brief Number of data lanes and their weights
+    /// \param Weight of each lane, at most max_lanes of them
+    /// \param Bytes a lane of weight 1 may send per round
+    void configure(const std::vector<unsigned> & weights, std::size_t quantum){
+        std::size_t const most = max_lanes;
+        lane_count_ = (std::max)(std::size_t{1}, (std::min)(weights.size(), most));
+        for(std::size_t i = 0; i < lane_count_; ++i)
+            lanes_[i].quantum = (std::max)(1u, i < weights.size() ? weights[i] : 1u) * (std::max)(std::size_t{1}, quantum);
+    }
+
+    std::size_t lanes() const{
+        return lane_count_;
+    }
+
+    /// \brief Queued data messages, the current one included
+    std::size_t size() const{
+        return size_;
+    }
+
+    /// \brief Queued data bytes, the unwritten rest of the current message included
+    std::size_t bytes() const{
+        return bytes_;
+    }
+
+    /// \brief Queued bytes still in files, not in memory
+    std::size_t file_bytes() const{
+        return file_bytes_;
+    }
+
+    bool empty() const{
+        return size_ == 0 && controls_.empty() && !close_;
+    }
+
+    void push(Buffer&& data, bool text, std::size_t lane_index = 0){
+        enqueue(std::move(data), text, lane_index, false, 0);
+    }
+
+    /// \brief Queue part of a file as a binary message, the queue owns its descriptor
+    void push_file(file_range&& file, std::size_t lane_index = 0){
+        enqueue(Buffer{}, false, lane_index, false, 0, std::move(file));
+    }
+
+    /// \brief Queue a shared payload, the queue holds a reference to it
+    void push_shared(const basic_shared_message<Buffer> & shared, std::size_t lane_index = 0){
+        enqueue(Buffer{}, shared.text(), lane_index, false, 0, {}, shared);
+    }
+
+    /// \brief A message with this key waits to be written
+    bool contains(std::uint64_t key) const{
+        return keys_.find(key) != nullptr;
+    }
+
+    /// \brief Bytes of the message with this key waiting to be written, 0 if none
+    std::size_t latest_size(std::uint64_t key) const{
+        auto const m = keys_.find(key);
+        return m != nullptr ? m->data.size() : 0;
+    }
+
+    /// \brief Queue a message, or replace the queued one with the same key
+    /// \return false if an earlier message was replaced
+    bool push_latest(std::uint64_t key, Buffer&& data, bool text, std::size_t lane_index = 0){
+        if(close_)
+            return true;
+
+        if(auto const m = keys_.find(key)){
+            bytes_ -= m->data.size();
+            m->data = std::move(data);
+            m->text = text;
+            bytes_ += m->data.size();
+            return false;
+        }
+
+        enqueue(std::move(data), text, lane_index, true, key);
+        return true;
+    }
+
+    void push_control(boost::beast::websocket::frame_type kind,
+                      boost::beast::websocket::ping_data const & payload){
+        if(!close_)
+            controls_.push_back({kind, payload});
+    }
+
+    /// \brief Queue a close frame. Data not yet started is dropped
+    void push_close(boost::beast::websocket::close_reason const & reason){
+        if(close_)
+            return;
+
+        close_ = true;
+        close_reason_ = reason;
+        clear();
+    }
+
+    bool has_control() const{
+        return !controls_.empty();
+    }
+
+    control pop_control(){
+        auto c = controls_.front();
+        controls_.erase(controls_.begin());
+        return c;
+    }
+
+    /// \brief Close frame queued behind the other control frames
+    bool has_close() const{
+        return close_ && controls_.empty();
+    }
+
+    boost::beast::websocket::close_reason const & close_reason() const{
+        return close_reason_;
+    }
+
+    /// \brief Message being written, or the next one by priority
+    message* current(){
+        if(current_ != nullptr || size_ == 0)
+            return current_;
+
+        skip_rounds();
+
+        for(;;){
+            auto & ln = lanes_[next_lane_];
+
+            if(ln.head != nullptr && ln.head->size() <= ln.deficit){
+                current_ = ln.head;
+                unlink(current_);
+                ln.head = current_->next;
+                if(ln.head == nullptr){
+                    ln.tail = nullptr;
+                    ln.deficit = 0;
+                }
+                else
+                    ln.deficit -= static_cast<std::size_t>(current_->size());
+                return current_;
+            }
+
+            // the lane has used its share of this round
+            if(ln.head == nullptr)
+                ln.deficit = 0;
+
+            next_lane_ = (next_lane_ + 1) % lane_count_;
+
+            auto & next = lanes_[next_lane_];
+            if(next.head != nullptr)
+                next.deficit += next.quantum;
+        }
+    }
+
+    /// \brief Account for written bytes of the current message
+    void consume(std::size_t n){
+        if(current_->shared)
+            current_->shared_offset += n;
+        else
+            current_->data.consume(n);
+        bytes_ -= n;
+    }
+
+    /// \brief The current message is written completely
+    void pop(){
+        bytes_ -= current_->size();
+        file_bytes_ -= current_->file.length;
+        --size_;
+        destroy(current_);
+        current_ = nullptr;
+    }
+
+    /// \brief Take the data of the current message, which leaves the queue
+    /// unwritten (e.g. to be written by a zerocopy_writer)
+    Buffer release_current(){
+        auto data = std::move(current_->data);
+        bytes_ -= data.size();
+        --size_;
+        destroy(current_);
+        current_ = nullptr;
+        return data;
+    }
+
+    /// \brief The file of the current message, deferred until now, is open
+    void opened(file_range&& file){
+        current_->file = file;
+        file.fd = -1;
+        bytes_ += current_->file.length;
+        file_bytes_ += current_->file.length;
+    }
+
+    /// \brief The next chunk of the current message was read from its file
+    /// (file_range::read on a copy of it)
+    void filled(Buffer&& chunk){
+        auto const n = chunk.size();
+        current_->data = std::move(chunk);
+        current_->file.offset += n;
+        current_->file.length -= n;
+        file_bytes_ -= n;
+    }
+
+    /// \brief Take the file of the current message, which leaves the queue
+    /// unwritten (e.g. to be written by a file_writer)
+    file_range release_file(){
+        auto file = current_->file;
+        current_->file.fd = -1;
+        bytes_ -= current_->size();
+        file_bytes_ -= file.length;
+        --size_;
+        destroy(current_);
+        current_ = nullptr;
+        return file;
+    }
+
+    /// \brief Queue time of the oldest data message, the current one included
+    std::chrono::steady_clock::time_point oldest() const{
+        auto t = current_ != nullptr ? current_->queued_at : (std::chrono::steady_clock::time_point::max)();
+        for(std::size_t i = 0; i < lane_count_; ++i)
+            if(lanes_[i].head != nullptr)
+                t = (std::min)(t, lanes_[i].head->queued_at);
+        return t;
+    }
+
+    /// \brief Drop the oldest data message not yet started
+    /// \param Set to the size of the dropped message
+    /// \return false if there is none
+    bool drop_oldest(std::size_t & dropped_bytes){
+        lane* from = nullptr;
+        for(std::size_t i = 0; i < lane_count_; ++i)
+            if(lanes_[i].head != nullptr
+                    && (from == nullptr || lanes_[i].head->queued_at < from->head->queued_at))
+                from = &lanes_[i];
+
+        if(from == nullptr)
+            return false;
+
+        auto const m = from->head;
+        from->head = m->next;
+        if(from->head == nullptr){
+            from->tail = nullptr;
+            from->deficit = 0;
+        }
+
+        unlink(m);
+
+        dropped_bytes = m->size();
+        bytes_ -= dropped_bytes;
+        file_bytes_ -= m->file.length;
+        --size_;
+        destroy(m);
+        return true;
+    }
+
+    /// \brief Drop all data messages not yet started
+    void clear(){
+        for(std::size_t i = 0; i < lane_count_; ++i){
+            auto & ln = lanes_[i];
+            while(ln.head != nullptr){
+                auto const m = ln.head;
+                ln.head = m->next;
+                unlink(m);
+                bytes_ -= m->size();
+                file_bytes_ -= m->file.length;
+                --size_;
+                destroy(m);
+            }
+            ln.tail = nullptr;
+            ln.deficit = 0;
+        }
+    }
+
+}; // outbound_queue class
+
+} // namespace base
+
+} // namespace ws
+
+#endif // BEAST_WS_QUEUE_HPP
@@ -0,0 +1,135 @@
+#ifndef BEAST_WS_RAW_FRAME_HPP
+#define BEAST_WS_RAW_FRAME_HPP
+
+#include <cerrno>
+#include <cstdint>
+
+#include <boost/asio/error.hpp>
+#include <boost/core/ignore_unused.hpp>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/socket.h>
+#endif
+
+namespace ws {
+
+namespace base {
+
+/// \brief Result of writing one frame next to the websocket stream
+/// (zerocopy_writer, file_writer)
+enum class frame_status{
+    // the message is written
+    message_done,
+    // a frame is written, more follow
+    frame_done,
+    // the socket is full, call again once it is writable
+    would_block,
+    failed
+};
+
+/// \brief Helpers for frames a server session writes to its socket itself
+/// Server frames are not masked, so the payload goes to the socket as it
+/// is, behind a header of at most 10 bytes. The stream knows nothing of
+/// these frames, so nothing else may reach the socket while one is partly
+/// written. Before each raw frame the session writes an empty frame
+/// through the stream, which waits for an automatic pong or close reply
+/// of the stream still on its way, and then holds the reads (read_batch)
+/// until the raw frame is out, so the stream starts no new one. The first
+/// of these empty frames opens the message, an empty final frame through
+/// the stream closes it, so the stream's own state of the message stays
+/// right; raw frames are continuation frames. A raw frame is written
+/// without blocking and resumed when the socket is writable.
+namespace raw_frame {
+
+constexpr std::size_t max_header = 10;
+
+/// \brief Raw frame on its way: the header, then the payload
+struct progress{
+    unsigned char header[max_header];
+    std::size_t header_size = 0;
+    std::size_t header_sent = 0;
+    std::uint64_t payload_left = 0;
+
+    bool active() const{
+        return header_sent < header_size || payload_left > 0;
+    }
+
+    /// \brief A non final continuation frame of `size` bytes
+    void start(std::uint64_t size){
+        header[0] = 0x00;
+
+        if(size < 126){
+            header[1] = static_cast<unsigned char>(size);
+            header_size = 2;
+        }
+        else if(size <= 0xffff){
+            header[1] = 126;
+            header[2] = static_cast<unsigned char>(size >> 8);
+            header[3] = static_cast<unsigned char>(size);
+            header_size = 4;
+        }
+        else{
+            header[1] = 127;
+            for(int i = 0; i < 8; ++i)
+                header[2 + i] = static_cast<unsigned char>(size >> (56 - 8 * i));
+            header_size = 10;
+        }
+
+        header_sent = 0;
+        payload_left = size;
+    }
+};
+
+inline boost::system::error_code last_error(){
+    return {errno, boost::system::system_category()};
+}
+
+/// \brief The socket returns EAGAIN instead of blocking, sendfile has no
+/// per call flag for it
+inline bool non_blocking(int fd, boost::system::error_code & ec){
+#if defined(__linux__)
+    int const flags = ::fcntl(fd, F_GETFL, 0);
+    if(flags < 0 || (!(flags & O_NONBLOCK) && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)){
+        ec = last_error();
+        return false;
+    }
+    return true;
+#else
+    boost::ignore_unused(fd);
+    ec = boost::asio::error::operation_not_supported;
+    return false;
+#endif
+}
+
+/// \brief Send what is left of the header, the payload follows (MSG_MORE)
+/// \return false if the socket is full (ec clear) or on failure
+inline bool send_header(int fd, progress & frame, boost::system::error_code & ec){
+#if defined(__linux__)
+    while(frame.header_sent < frame.header_size){
+        auto const r = ::send(fd, frame.header + frame.header_sent, frame.header_size - frame.header_sent,
+                              MSG_NOSIGNAL | MSG_DONTWAIT | MSG_MORE);
+        if(r < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                ec = last_error();
+            return false;
+        }
+        frame.header_sent += static_cast<std::size_t>(r);
+    }
+    return true;
+#else
+    boost::ignore_unused(fd, frame);
+    ec = boost::asio::error::operation_not_supported;
+    return false;
+#endif
+}
+
+} // namespace raw_frame
+
+} // namespace base
+
+} // namespace ws
+
+#endif // BEAST_WS_RAW_FRAME_HPP
@@ -0,0 +1,220 @@
+#ifndef BEAST_WS_READ_BATCH_HPP
+#define BEAST_WS_READ_BATCH_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/post.hpp>
+
+namespace ws {
+
+/// \brief Messages read per wakeup, summed over all sessions
+/// Bucket i counts the wakeups that read at most 2^i messages (1, 2, 3-4,
+/// 5-8, ...), the last bucket the larger ones.
+struct read_batch_counters{
+    static constexpr std::size_t buckets = 8;
+
+    std::array<std::atomic<std::uint64_t>, buckets> wakeups{};
+    std::atomic<std::uint64_t> messages{0};
+    // batches cut short by session_options::read_batch
+    std::atomic<std::uint64_t> yields{0};
+
+    /// \brief Mean messages per wakeup
+    double mean() const{
+        std::uint64_t total = 0;
+        for(auto const & w : wakeups)
+            total += w.load(std::memory_order_relaxed);
+        return total > 0 ? static_cast<double>(messages.load(std::memory_order_relaxed)) / total : 0;
+    }
+};
+
+inline read_batch_counters & read_batch_stats(){
+    static read_batch_counters instance;
+    return instance;
+}
+
+namespace base {
+
+/// \brief Messages a session reads back to back
+/// A read whose message the stream already holds completes at once, and
+/// the stream posts the completion handler. While the session has armed
+/// the batch, batch_executor runs that handler in place instead: the
+/// buffered messages are handled one after the other on the stack, until
+/// the budget is spent or a read has to wait for the socket.
+/// While the session writes a raw frame (raw_frame.hpp) it holds the
+/// reads: their handlers are parked, so the stream can not answer a ping
+/// or a close in the middle of the frame, and go on when it is released.
+/// Only touched on the session strand.
+class read_batch{
+
+    struct parked_base{
+        virtual ~parked_base() = default;
+        virtual void run() = 0;
+    };
+
+    template<class F>
+    struct parked_handler : parked_base{
+        F f;
+
+        explicit parked_handler(F&& handler)
+            : f{std::move(handler)}
+        {}
+
+        void run() override{
+            f();
+        }
+    };
+
+    std::vector<std::unique_ptr<parked_base>> parked_;
+
+public:
+
+    // messages of the current batch
+    std::size_t messages = 0;
+    // messages ever read, tells a session whether its read completed in place
+    std::size_t handled = 0;
+    // the next read may complete in place
+    bool armed = false;
+    // the read handlers wait for release()
+    bool held = false;
+
+    /// \brief A message is read
+    void add(){
+        ++messages;
+        ++handled;
+    }
+
+    /// \brief The read has to wait, count the batch
+    /// \param Messages the batch may have
+    void finish(std::size_t budget){
+        if(messages == 0)
+            return;
+
+        std::size_t bucket = 0;
+        while(bucket + 1 < read_batch_counters::buckets && (std::size_t{1} << bucket) < messages)
+            ++bucket;
+
+        auto & stats = read_batch_stats();
+        stats.wakeups[bucket].fetch_add(1, std::memory_order_relaxed);
+        stats.messages.fetch_add(messages, std::memory_order_relaxed);
+        if(budget > 1 && messages >= budget)
+            stats.yields.fetch_add(1, std::memory_order_relaxed);
+
+        messages = 0;
+    }
+
+    void hold(){
+        held = true;
+    }
+
+    template<class F>
+    void park(F&& f){
+        parked_.push_back(std::make_unique<parked_handler<F>>(std::move(f)));
+    }
+
+    /// \brief Let the read handlers on, in the order they came
+    template<class Executor>
+    void release(const Executor & ex){
+        held = false;
+
+        for(auto & p : parked_)
+            boost::asio::post(ex, [p = std::move(p)]{ p->run(); });
+
+        parked_.clear();
+    }
+
+}; // read_batch class
+
+/// \brief Executor of the reads of a session, a strand that runs the
+/// handlers posted while its read_batch is armed in place, and parks them
+/// while it is held
+template<class Executor>
+class batch_executor{
+
+    Executor inner_;
+    read_batch* batch_;
+
+    // runs on the strand, where held may be read
+    template<class F>
+    struct gate{
+        read_batch* batch;
+        F f;
+
+        void operator()(){
+            if(batch->held)
+                batch->park(std::move(f));
+            else
+                f();
+        }
+    };
+
+    template<class F>
+    gate<typename std::decay<F>::type> gated(F&& f) const{
+        return {batch_, std::forward<F>(f)};
+    }
+
+public:
+
+    batch_executor(const Executor & inner, read_batch & batch)
+        : inner_{inner}, batch_{&batch}
+    {}
+
+    decltype(auto) context() const noexcept{
+        return inner_.context();
+    }
+
+    void on_work_started() const noexcept{
+        inner_.on_work_started();
+    }
+
+    void on_work_finished() const noexcept{
+        inner_.on_work_finished();
+    }
+
+    template<class F, class A>
+    void dispatch(F&& f, const A & a) const{
+        inner_.dispatch(gated(std::forward<F>(f)), a);
+    }
+
+    template<class F, class A>
+    void post(F&& f, const A & a) const{
+        // posted by the read being started, which is on the strand
+        if(batch_->armed && !batch_->held){
+            typename std::decay<F>::type handler(std::forward<F>(f));
+            handler();
+            return;
+        }
+
+        inner_.post(gated(std::forward<F>(f)), a);
+    }
+
+    template<class F, class A>
+    void defer(F&& f, const A & a) const{
+        inner_.defer(gated(std::forward<F>(f)), a);
+    }
+
+    bool running_in_this_thread() const noexcept{
+        return inner_.running_in_this_thread();
+    }
+
+    friend bool operator==(const batch_executor & a, const batch_executor & b) noexcept{
+        return a.inner_ == b.inner_ && a.batch_ == b.batch_;
+    }
+
+    friend bool operator!=(const batch_executor & a, const batch_executor & b) noexcept{
+        return !(a == b);
+    }
+
+}; // batch_executor class
+
+} // namespace base
+
+} // namespace ws
+
+#endif // BEAST_WS_READ_BATCH_HPP
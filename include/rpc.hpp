@@ -0,0 +1,373 @@
+#ifndef BEAST_WS_RPC_HPP
+#define BEAST_WS_RPC_HPP
+
+#include "session.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <boost/asio/steady_timer.hpp>
+
+namespace ws {
+
+namespace rpc {
+
+/// \brief Outcome of a call
+enum class status{
+    ok,
+    timeout,
+    cancelled,
+    closed
+};
+
+using reply_handler = std::function<void(status, boost::beast::string_view)>;
+
+/// \brief Calls in flight, keyed by correlation id
+/// Open addressing with linear probing and backward shift deletion, so
+/// there are no tombstones and the table only allocates when it grows.
+/// Id 0 marks an empty slot.
+class pending_table{
+
+    struct slot{
+        std::uint64_t id = 0;
+        std::chrono::steady_clock::time_point deadline;
+        reply_handler handler;
+    };
+
+    std::vector<slot> slots_;
+    std::size_t size_ = 0;
+
+    std::size_t home(std::uint64_t id) const{
+        return static_cast<std::size_t>(id * 11400714819323198485ULL) & (slots_.size() - 1);
+    }
+
+    std::size_t locate(std::uint64_t id) const{
+        auto const mask = slots_.size() - 1;
+        auto pos = home(id);
+        while(slots_[pos].id != 0 && slots_[pos].id != id)
+            pos = (pos + 1) & mask;
+        return pos;
+    }
+
+    void grow(){
+        std::vector<slot> old(slots_.empty() ? 16 : slots_.size() * 2);
+        old.swap(slots_);
+
+        for(auto & s : old)
+            if(s.id != 0)
+                slots_[locate(s.id)] = std::move(s);
+    }
+
+public:
+
+    std::size_t size() const{
+        return size_;
+    }
+
+    void insert(std::uint64_t id, std::chrono::steady_clock::time_point deadline, reply_handler handler){
+        if((size_ + 1) * 2 > slots_.size())
+            grow();
+
+        auto & s = slots_[locate(id)];
+        s.id = id;
+        s.deadline = deadline;
+        s.handler = std::move(handler);
+        ++size_;
+    }
+
+    /// \brief Remove a call, returns its handler (empty if not in flight)
+    reply_handler take(std::uint64_t id){
+        if(size_ == 0)
+            return {};
+
+        auto const mask = slots_.size() - 1;
+        auto i = locate(id);
+        if(slots_[i].id == 0)
+            return {};
+
+        auto handler = std::move(slots_[i].handler);
+        --size_;
+
+        // shift the following entries of the run back
+        for(auto j = (i + 1) & mask; slots_[j].id != 0; j = (j + 1) & mask){
+            if(((j - home(slots_[j].id)) & mask) >= ((j - i) & mask)){
+                slots_[i] = std::move(slots_[j]);
+                i = j;
+            }
+        }
+
+        slots_[i] = slot{};
+        return handler;
+    }
+
+    template<class F>
+    void for_each(F&& f) const{
+        for(auto const & s : slots_)
+            if(s.id != 0)
+                f(s.id, s.deadline);
+    }
+
+    /// \brief Remove all calls, `f` receives each handler
+    template<class F>
+    void clear(F&& f){
+        std::vector<slot> old;
+        old.swap(slots_);
+        size_ = 0;
+
+        for(auto & s : old)
+            if(s.id != 0)
+                f(s.handler);
+    }
+
+}; // pending_table class
+
+/// \brief Request/response calls over a session, many in flight at once
+/// Frames are text safe: "<kind><id> <payload>", where kind is
+///          'q' - request
+///          'r' - reply
+///          'x' - cancel, no payload
+/// Replies are matched by id in any order, so throughput does not depend
+/// on the round trip time. All deadlines of a channel share one timer on
+/// the session strand, armed at the earliest of them.
+/// Use a channel on the session strand only (session handlers, or
+/// boost::asio::dispatch(channel->get_executor(), ...)).
+/// \tparam Session server or client session
+template<class Session>
+class channel : private boost::noncopyable,
+        public std::enable_shared_from_this<channel<Session> >
+{
+
+    using clock = std::chrono::steady_clock;
+    using deadline_t = std::pair<clock::time_point, std::uint64_t>;
+
+    std::weak_ptr<Session> session_;
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    boost::asio::steady_timer timer_;
+    clock::time_point armed_ = (clock::time_point::max)();
+
+    pending_table pending_;
+    // min-heap, entries of completed calls are dropped lazily
+    std::vector<deadline_t> deadlines_;
+
+    std::uint64_t next_id_ = 1;
+    std::string scratch_;
+
+    static typename Session::buffer_type frame(char kind, std::uint64_t id, boost::beast::string_view payload){
+        char head[22];
+        auto p = head + sizeof(head);
+        *--p = ' ';
+        do{
+            *--p = static_cast<char>('0' + id % 10);
+            id /= 10;
+        }while(id != 0);
+        *--p = kind;
+
+        std::array<boost::asio::const_buffer, 2> const parts{{
+            boost::asio::buffer(p, static_cast<std::size_t>(head + sizeof(head) - p)),
+            boost::asio::buffer(payload.data(), payload.size())
+        }};
+
+        typename Session::buffer_type out;
+        out.commit(boost::asio::buffer_copy(out.prepare(boost::asio::buffer_size(parts)), parts));
+        return out;
+    }
+
+    void send(char kind, std::uint64_t id, boost::beast::string_view payload){
+        if(auto const session = session_.lock())
+            session->send(frame(kind, id, payload));
+    }
+
+    void arm(clock::time_point deadline){
+        if(deadline >= armed_)
+            return;
+
+        armed_ = deadline;
+        timer_.expires_at(deadline);
+        timer_.async_wait(
+                    boost::asio::bind_executor(
+                        strand_,
+                        std::bind(
+                            &channel::on_timer,
+                            this->shared_from_this(),
+                            std::placeholders::_1)));
+    }
+
+    void compact(){
+        deadlines_.clear();
+        pending_.for_each([this](std::uint64_t id, clock::time_point deadline){
+            deadlines_.emplace_back(deadline, id);
+        });
+        std::make_heap(deadlines_.begin(), deadlines_.end(), std::greater<deadline_t>{});
+    }
+
+    void on_timer(const boost::system::error_code & ec){
+        // Re-armed for an earlier deadline, or cancelled
+        if(ec == boost::asio::error::operation_aborted)
+            return;
+
+        if(ec)
+            return logging::fail(ec, "rpc timer");
+
+        armed_ = (clock::time_point::max)();
+        auto const now = clock::now();
+
+        while(!deadlines_.empty() && deadlines_.front().first <= now){
+            auto const id = deadlines_.front().second;
+            std::pop_heap(deadlines_.begin(), deadlines_.end(), std::greater<deadline_t>{});
+            deadlines_.pop_back();
+
+            if(auto const handler = pending_.take(id))
+                handler(status::timeout, {});
+        }
+
+        if(!deadlines_.empty())
+            arm(deadlines_.front().first);
+    }
+
+public:
+
+    using ptr = std::shared_ptr<channel>;
+
+    // Incoming request, answer with reply(id, ...) now or later
+    std::function<void(std::uint64_t, boost::beast::string_view)> on_request;
+    // The peer gave up on a request
+    std::function<void(std::uint64_t)> on_cancel;
+
+    explicit channel(Session & session)
+        : session_{session.shared_from_this()},
+          strand_{session.getConnection()->strand()},
+          timer_{strand_.get_inner_executor().context()}
+    {}
+
+    static ptr make(Session & session){
+        return std::make_shared<channel>(session);
+    }
+
+    auto get_executor(){
+        return strand_;
+    }
+
+    std::size_t in_flight() const{
+        return pending_.size();
+    }
+
+    /// \brief Send a request without waiting for earlier replies
+    /// \param Request payload
+    /// \param Called once, with the reply, or on timeout, cancel or close
+    /// \param Deadline of the call
+    /// \return Correlation id, for cancel()
+    std::uint64_t call(boost::beast::string_view payload, reply_handler handler,
+                       clock::duration timeout = std::chrono::seconds(10)){
+        auto const id = next_id_++;
+        auto const deadline = clock::now() + timeout;
+
+        auto const session = session_.lock();
+        if(!session){
+            boost::asio::post(strand_, std::bind(std::move(handler), status::closed, boost::beast::string_view{}));
+            return id;
+        }
+
+        pending_.insert(id, deadline, std::move(handler));
+
+        if(deadlines_.size() > pending_.size() * 2 + 64)
+            compact();
+        else{
+            deadlines_.emplace_back(deadline, id);
+            std::push_heap(deadlines_.begin(), deadlines_.end(), std::greater<deadline_t>{});
+        }
+
+        arm(deadline);
+
+        session->send(frame('q', id, payload));
+        return id;
+    }
+
+    /// \brief Answer a request received through on_request
+    void reply(std::uint64_t id, boost::beast::string_view payload){
+        send('r', id, payload);
+    }
+
+    /// \brief Give up on a call, its handler runs with status::cancelled
+    /// \return false if the call already completed
+    bool cancel(std::uint64_t id){
+        auto const handler = pending_.take(id);
+        if(!handler)
+            return false;
+
+        send('x', id, {});
+        handler(status::cancelled, {});
+        return true;
+    }
+
+    /// \brief Fail every call in flight with status::closed
+    /// Typically called from the on_close handler of the session.
+    void close(){
+        boost::system::error_code ec;
+        timer_.cancel(ec);
+        armed_ = (clock::time_point::max)();
+        deadlines_.clear();
+
+        pending_.clear([](reply_handler & handler){
+            handler(status::closed, {});
+        });
+    }
+
+    /// \brief Feed a received message to the channel
+    /// \return false if the message is not an rpc frame
+    template<class ConstBufferSequence>
+    bool dispatch(const ConstBufferSequence & buffers){
+        boost::beast::string_view message;
+
+        auto const first = boost::asio::buffer_sequence_begin(buffers);
+        auto const last = boost::asio::buffer_sequence_end(buffers);
+
+        if(first != last && std::next(first) == last){
+            boost::asio::const_buffer const b = *first;
+            message = {static_cast<const char*>(b.data()), b.size()};
+        }else{
+            scratch_.resize(boost::asio::buffer_size(buffers));
+            boost::asio::buffer_copy(boost::asio::buffer(&scratch_[0], scratch_.size()), buffers);
+            message = scratch_;
+        }
+
+        if(message.size() < 2)
+            return false;
+
+        auto const kind = message[0];
+        if(kind != 'q' && kind != 'r' && kind != 'x')
+            return false;
+
+        std::uint64_t id = 0;
+        std::size_t i = 1;
+        for(; i < message.size() && message[i] >= '0' && message[i] <= '9'; ++i)
+            id = id * 10 + static_cast<std::uint64_t>(message[i] - '0');
+
+        if(i == 1 || i == message.size() || message[i] != ' ')
+            return false;
+
+        auto const payload = message.substr(i + 1);
+
+        if(kind == 'r'){
+            // late replies of timed out or cancelled calls are dropped
+            if(auto const handler = pending_.take(id))
+                handler(status::ok, payload);
+        }
+        else if(kind == 'q'){
+            if(on_request)
+                on_request(id, payload);
+        }
+        else if(on_cancel)
+            on_cancel(id);
+
+        return true;
+    }
+
+}; // channel class
+
+} // namespace rpc
+
+} // namespace ws
+
+#endif // BEAST_WS_RPC_HPP
@@ -0,0 +1,392 @@
+#ifndef BEAST_WS_SENDFILE_HPP
+#define BEAST_WS_SENDFILE_HPP
+
+#include "raw_frame.hpp"
+#include "work_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/core/noncopyable.hpp>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ws {
+
+/// \brief send_file counters, summed over all sessions
+struct sendfile_counters{
+    std::atomic<std::uint64_t> files{0};
+    // spliced from the page cache to the socket
+    std::atomic<std::uint64_t> direct_bytes{0};
+    // read into buffers and written by the stream
+    std::atomic<std::uint64_t> buffered_bytes{0};
+};
+
+inline sendfile_counters & sendfile_stats(){
+    static sendfile_counters instance;
+    return instance;
+}
+
+namespace base {
+
+/// \brief Threads that open and read the files of send_file, so that no
+/// disk read runs on an io thread. Two of them, started with the first
+/// file (see session_options::file_pool)
+inline work_pool & file_pool(){
+    static work_pool instance;
+    instance.start(2);
+    return instance;
+}
+
+/// \brief Part of an open file sent as one binary message
+/// The descriptor belongs to the range, a range that is dropped unsent
+/// must be closed. A range of a path is only opened when its turn comes
+/// (deferred), on the file pool.
+struct file_range{
+    int fd = -1;
+    std::uint64_t offset = 0;
+    // bytes not yet sent, or read into a buffer
+    std::uint64_t length = 0;
+    // the kernel can send it from the page cache (a regular file)
+    bool direct = false;
+    // path of a deferred range, and the bytes asked for
+    std::string path;
+    std::uint64_t requested = 0;
+
+    static constexpr std::uint64_t to_end = (std::numeric_limits<std::uint64_t>::max)();
+
+    /// \brief Range of a file of our own
+    /// \param Descriptor, duplicated, the caller keeps it
+    /// \param First byte
+    /// \param Bytes from there, to_end for the rest of the file
+    static file_range open(int fd, std::uint64_t offset, std::uint64_t length,
+                           boost::system::error_code & ec){
+        file_range range;
+
+        struct stat st;
+        if(::fstat(fd, &st) != 0){
+            ec = raw_frame::last_error();
+            return range;
+        }
+
+        if(S_ISREG(st.st_mode)){
+            auto const size = static_cast<std::uint64_t>(st.st_size);
+            if(offset > size){
+                ec = boost::asio::error::invalid_argument;
+                return range;
+            }
+            length = (std::min)(length, size - offset);
+#if defined(__linux__)
+            range.direct = true;
+#endif
+        }
+        else if(length == to_end){
+            // a pipe or device has no end to send to
+            ec = boost::asio::error::invalid_argument;
+            return range;
+        }
+
+        range.fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if(range.fd < 0){
+            ec = raw_frame::last_error();
+            return range;
+        }
+
+        range.offset = offset;
+        range.length = length;
+        return range;
+    }
+
+    static file_range open(const std::string & path, std::uint64_t offset, std::uint64_t length,
+                           boost::system::error_code & ec){
+        int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0){
+            ec = raw_frame::last_error();
+            return {};
+        }
+
+        auto range = open(fd, offset, length, ec);
+        ::close(fd);
+        return range;
+    }
+
+    /// \brief Range of a path, opened later with open_deferred
+    static file_range deferred(const std::string & path, std::uint64_t offset, std::uint64_t length){
+        file_range range;
+        range.path = path;
+        range.offset = offset;
+        range.requested = length;
+        return range;
+    }
+
+    bool is_deferred() const{
+        return fd < 0 && !path.empty();
+    }
+
+    /// \brief Open a deferred range, blocks on the disk
+    file_range open_deferred(boost::system::error_code & ec) const{
+        return open(path, offset, requested, ec);
+    }
+
+    void close(){
+        if(fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+
+    /// \brief Read up to `size` bytes of the range into a buffer, blocks
+    /// on the disk
+    template<class Buffer>
+    bool read(Buffer & buffer, std::size_t size, boost::system::error_code & ec){
+        size = static_cast<std::size_t>((std::min<std::uint64_t>)(size, length));
+
+        auto const n = buffer_read(buffer.prepare(size), ec);
+        buffer.commit(n);
+
+        if(ec)
+            return false;
+
+        if(n < size){
+            // the file got shorter since
+            ec = boost::asio::error::eof;
+            return false;
+        }
+
+        sendfile_stats().buffered_bytes.fetch_add(n, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+
+    template<class MutableBuffers>
+    std::size_t buffer_read(const MutableBuffers & buffers, boost::system::error_code & ec){
+        std::size_t total = 0;
+
+        for(auto it = boost::asio::buffer_sequence_begin(buffers);
+                it != boost::asio::buffer_sequence_end(buffers); ++it){
+            boost::asio::mutable_buffer const b = *it;
+            auto data = static_cast<char*>(b.data());
+            auto left = b.size();
+
+            while(left > 0){
+                auto const r = ::pread(fd, data, left, static_cast<off_t>(offset));
+                if(r < 0 && errno == EINTR)
+                    continue;
+                if(r < 0){
+                    ec = raw_frame::last_error();
+                    return total;
+                }
+                if(r == 0)
+                    return total;
+
+                data += r;
+                left -= static_cast<std::size_t>(r);
+                offset += static_cast<std::uint64_t>(r);
+                length -= static_cast<std::uint64_t>(r);
+                total += static_cast<std::size_t>(r);
+            }
+        }
+
+        return total;
+    }
+
+};
+
+/// \brief Writes a file range of a server session as a binary message,
+/// the file pages go from the page cache to the socket
+/// A frame is spliced from the file into a pipe first, on a file pool
+/// thread (fill), where reading the disk may block. The io thread splices
+/// it on from the pipe to the socket without blocking, so a frame is at
+/// most what the pipe holds (1 MB if the system allows, 64 KB otherwise).
+/// Frames are written next to the websocket stream (see raw_frame.hpp).
+/// A file that can not be sent this way (not a regular file, or off Linux)
+/// is read into the message buffer and written by the stream instead.
+class file_writer : private boost::noncopyable{
+
+    // offset and length: the part not yet in the pipe
+    file_range file_;
+    // bytes of the message not yet sent
+    std::uint64_t unsent_ = 0;
+    bool active_ = false;
+    raw_frame::progress frame_;
+
+    int pipe_[2] = {-1, -1};
+    std::size_t capacity_ = 0;
+    // bytes of the file in the pipe
+    std::size_t piped_ = 0;
+
+    void close_pipe(){
+        for(auto & fd : pipe_){
+            if(fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+        piped_ = 0;
+    }
+
+public:
+
+    using status = frame_status;
+
+    ~file_writer(){
+        file_.close();
+        close_pipe();
+    }
+
+    /// \brief A message is being written
+    bool active() const{
+        return active_;
+    }
+
+    /// \brief Unsent bytes of the current message
+    std::uint64_t remaining() const{
+        return active_ ? unsent_ : 0;
+    }
+
+    /// \brief Take over a file range to write
+    /// \return false if there is no pipe for it, the range is closed
+    bool start(file_range&& file, boost::system::error_code & ec){
+#if defined(__linux__)
+        // what an ended message left in it
+        if(piped_ > 0)
+            close_pipe();
+
+        if(pipe_[0] < 0){
+            if(::pipe2(pipe_, O_CLOEXEC) != 0){
+                ec = raw_frame::last_error();
+                file.close();
+                return false;
+            }
+            ::fcntl(pipe_[1], F_SETPIPE_SZ, 1024 * 1024);
+
+            auto const size = ::fcntl(pipe_[1], F_GETPIPE_SZ);
+            capacity_ = size > 0 ? static_cast<std::size_t>(size) : 64 * 1024;
+        }
+
+        file_ = file;
+        file.fd = -1;
+        unsent_ = file_.length;
+        frame_ = {};
+        active_ = true;
+        return true;
+#else
+        file.close();
+        ec = boost::asio::error::operation_not_supported;
+        return false;
+#endif
+    }
+
+    /// \brief The next frame has to be read into the pipe (fill) before
+    /// write_frame. Call on the session strand
+    bool needs_fill() const{
+        return active_ && piped_ == 0 && !frame_.active();
+    }
+
+    /// \brief Read the next frame into the pipe, on a file pool thread
+    /// while the session waits for it
+    /// \param Payload bytes per frame, zero for no limit
+    /// \param Set on failure
+    void fill(std::size_t fragment, boost::system::error_code & ec){
+#if defined(__linux__)
+        auto left = (std::min<std::uint64_t>)(file_.length, capacity_);
+        if(fragment > 0)
+            left = (std::min<std::uint64_t>)(left, fragment);
+
+        while(left > 0){
+            auto offset = static_cast<loff_t>(file_.offset);
+            auto const r = ::splice(file_.fd, &offset, pipe_[1], nullptr,
+                                    static_cast<std::size_t>(left), SPLICE_F_MOVE);
+
+            if(r < 0 && errno == EINTR)
+                continue;
+
+            if(r < 0){
+                ec = raw_frame::last_error();
+                return;
+            }
+
+            // the file got shorter since, the message can not be completed
+            if(r == 0){
+                ec = boost::asio::error::eof;
+                return;
+            }
+
+            file_.offset += static_cast<std::uint64_t>(r);
+            file_.length -= static_cast<std::uint64_t>(r);
+            piped_ += static_cast<std::size_t>(r);
+            left -= static_cast<std::uint64_t>(r);
+        }
+#else
+        boost::ignore_unused(fragment);
+        ec = boost::asio::error::operation_not_supported;
+#endif
+    }
+
+    /// \brief Write the frame in the pipe, or what is left of the frame the
+    /// socket took in part
+    /// \param Socket of the session
+    /// \param Set on failure
+    status write_frame(boost::asio::ip::tcp::socket & socket, boost::system::error_code & ec){
+#if defined(__linux__)
+        int const fd = socket.native_handle();
+
+        if(!frame_.active()){
+            // the pipe side is SPLICE_F_NONBLOCK, the socket side needs this
+            if(!raw_frame::non_blocking(fd, ec))
+                return status::failed;
+
+            frame_.start(piped_);
+        }
+
+        if(!raw_frame::send_header(fd, frame_, ec))
+            return ec ? status::failed : status::would_block;
+
+        while(frame_.payload_left > 0){
+            auto const r = ::splice(pipe_[0], nullptr, fd, nullptr, static_cast<std::size_t>(frame_.payload_left),
+                                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if(r < 0 && errno == EINTR)
+                continue;
+
+            if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return status::would_block;
+
+            if(r < 0){
+                ec = raw_frame::last_error();
+                return status::failed;
+            }
+
+            piped_ -= static_cast<std::size_t>(r);
+            unsent_ -= static_cast<std::uint64_t>(r);
+            frame_.payload_left -= static_cast<std::uint64_t>(r);
+            sendfile_stats().direct_bytes.fetch_add(static_cast<std::uint64_t>(r), std::memory_order_relaxed);
+        }
+
+        if(unsent_ > 0)
+            return status::frame_done;
+
+        file_.close();
+        active_ = false;
+        return status::message_done;
+#else
+        boost::ignore_unused(socket);
+        ec = boost::asio::error::operation_not_supported;
+        return status::failed;
+#endif
+    }
+
+}; // file_writer class
+
+} // namespace base
+
+} // namespace ws
+
+#endif // BEAST_WS_SENDFILE_HPP
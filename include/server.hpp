@@ -1,22 +1,592 @@
 #ifndef BEAST_WS_SERVER_HPP
 #define BEAST_WS_SERVER_HPP
 
+#include "coro.hpp"
 #include "session.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <initializer_list>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <sys/stat.h>
+
 namespace ws {
 
+/// \brief Route table of the standalone listener
+/// Exact match of the request target (the query string is ignored).
+/// Open addressing over precomputed hashes, a lookup does not allocate.
+class path_table{
+
+public:
+
+    using handler_type = std::function<void(session<true>&, const boost::beast::websocket::request_type&)>;
+
+private:
+
+    struct entry{
+        std::string path;
+        std::size_t hash;
+        handler_type handler;
+    };
+
+    std::vector<entry> entries_;
+    // index + 1 into entries_, 0 is an empty slot
+    std::vector<std::size_t> slots_;
+
+    static std::size_t hash(boost::beast::string_view s){
+        // FNV-1a
+        std::size_t h = 14695981039346656037ULL;
+        for(auto c : s){
+            h ^= static_cast<unsigned char>(c);
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    void rehash(){
+        std::size_t size = 8;
+        while(size < entries_.size() * 2)
+            size <<= 1;
+
+        slots_.assign(size, 0);
+
+        for(std::size_t i = 0; i < entries_.size(); ++i){
+            auto pos = entries_[i].hash & (size - 1);
+            while(slots_[pos] != 0)
+                pos = (pos + 1) & (size - 1);
+            slots_[pos] = i + 1;
+        }
+    }
+
+public:
+
+    path_table()
+    {}
+
+    path_table(std::initializer_list<std::pair<std::string, handler_type>> routes){
+        for(auto const & route : routes)
+            add(route.first, route.second);
+    }
+
+    void add(const std::string & path, handler_type handler){
+        auto const h = hash(path);
+
+        for(auto & e : entries_)
+            if(e.hash == h && e.path == path){
+                e.handler = std::move(handler);
+                return;
+            }
+
+        entries_.push_back({path, h, std::move(handler)});
+        rehash();
+    }
+
+    const handler_type* find(boost::beast::string_view target) const{
+        auto const query = target.find('?');
+        if(query != boost::beast::string_view::npos)
+            target = target.substr(0, query);
+
+        if(slots_.empty())
+            return nullptr;
+
+        auto const h = hash(target);
+        auto const mask = slots_.size() - 1;
+
+        for(auto pos = h & mask; slots_[pos] != 0; pos = (pos + 1) & mask){
+            auto const & e = entries_[slots_[pos] - 1];
+            if(e.hash == h && boost::beast::string_view{e.path} == target)
+                return &e.handler;
+        }
+
+        return nullptr;
+    }
+
+}; // path_table class
+
 /// \brief ws server class
 class server_impl{
 
     std::function<void(boost::beast::websocket::response_type&)> decorator_;
 
+    // created with the first limited upgrade
+    std::unique_ptr<base::handshake_gate> gate_;
+    std::once_flag gate_once_;
+
+    base::handshake_gate & gate(){
+        std::call_once(gate_once_, [this]{
+            gate_ = std::make_unique<base::handshake_gate>(http::base::processor::get().io_service(), admission);
+        });
+        return *gate_;
+    }
+
+    // live sessions, for drain()
+    std::mutex sessions_mutex_;
+    std::vector<std::weak_ptr<session<true>>> sessions_;
+    std::size_t sessions_pruned_ = 0;
+    std::atomic<bool> draining_{false};
+
+    struct drain_state{
+        boost::asio::steady_timer timer;
+        std::vector<std::weak_ptr<session<true>>> sessions;
+        std::size_t next;
+        base::token_bucket closes;
+        std::chrono::steady_clock::time_point deadline;
+        std::function<void()> on_drained;
+    };
+
+    void track(session<true> & session){
+        std::lock_guard<std::mutex> lock{sessions_mutex_};
+
+        // drop expired entries once the list has doubled since the last pass
+        if(sessions_.size() >= 2 * sessions_pruned_ + 64){
+            sessions_.erase(std::remove_if(sessions_.begin(), sessions_.end(),
+                                           [](const std::weak_ptr<ws::session<true>> & p){ return p.expired(); }),
+                            sessions_.end());
+            sessions_pruned_ = sessions_.size();
+        }
+
+        sessions_.push_back(session.shared_from_this());
+    }
+
+    // listening sockets of listen(), closed by drain()
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> listeners_;
+    // serializes the accept loops, the drain and the handoff
+    std::unique_ptr<boost::asio::strand<boost::asio::io_context::executor_type>> listen_strand_;
+    std::once_flag listen_strand_once_;
+
+    boost::asio::strand<boost::asio::io_context::executor_type> & listen_strand(){
+        std::call_once(listen_strand_once_, [this]{
+            listen_strand_ = std::make_unique<boost::asio::strand<boost::asio::io_context::executor_type>>(
+                        http::base::processor::get().io_service().get_executor());
+        });
+        return *listen_strand_;
+    }
+
+    // The routes of a listener live as long as its accept loop and the
+    // sessions still reading their upgrade request
+    void accept_next(boost::asio::ip::tcp::acceptor & acceptor,
+                     const std::shared_ptr<const path_table> & routes){
+        acceptor.async_accept(
+                    boost::asio::bind_executor(
+                        listen_strand(),
+                        [this, &acceptor, routes](const boost::system::error_code & ec,
+                                                  boost::asio::ip::tcp::socket socket){
+            // closed by the drain or the handoff
+            if(ec == boost::asio::error::operation_aborted)
+                return;
+
+            if(ec)
+                logging::fail(ec, "accept");
+            else
+                admit(std::move(socket), boost::beast::flat_buffer{}, [routes](session<true> & session){
+                    session.do_read_upgrade(routes);
+                });
+
+            accept_next(acceptor, routes);
+        }));
+    }
+
+    static void bind(boost::asio::ip::tcp::acceptor & acceptor,
+                     const boost::asio::ip::tcp::endpoint & endpoint,
+                     boost::system::error_code & ec){
+        acceptor.open(endpoint.protocol(), ec);
+        if(!ec)
+            acceptor.set_option(boost::asio::socket_base::reuse_address(true), ec);
+        if(!ec)
+            acceptor.bind(endpoint, ec);
+        if(!ec)
+            acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+    }
+
+    // On the listen strand
+    void close_listeners(){
+        boost::system::error_code ec;
+        for(auto const & acceptor : listeners_)
+            acceptor->close(ec);
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        for(auto const & acceptor : acceptors_)
+            acceptor->close(ec);
+#endif
+    }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    // listening sockets of listen(..., inherited), they can be handed off
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors_;
+    std::unique_ptr<boost::asio::local::stream_protocol::acceptor> handoff_acceptor_;
+
+    struct handoff_state{
+        boost::asio::local::stream_protocol::socket channel;
+        std::vector<std::weak_ptr<session<true>>> sessions;
+        std::chrono::steady_clock::duration min_idle;
+        std::chrono::steady_clock::duration drain_timeout;
+        // sessions not looked at yet
+        std::atomic<std::size_t> pending;
+        std::mutex mutex;
+
+        handoff_state(boost::asio::local::stream_protocol::socket && channel_,
+                      std::vector<std::weak_ptr<session<true>>> && sessions_,
+                      std::chrono::steady_clock::duration min_idle_,
+                      std::chrono::steady_clock::duration drain_timeout_)
+            : channel{std::move(channel_)},
+              sessions{std::move(sessions_)},
+              min_idle{min_idle_},
+              drain_timeout{drain_timeout_},
+              pending{sessions.size()}
+        {}
+    };
+
+    // Runs on the listen strand: listeners first, then every idle session,
+    // the rest is drained
+    void hand_off(boost::asio::local::stream_protocol::socket && channel,
+                  std::chrono::steady_clock::duration min_idle,
+                  std::chrono::steady_clock::duration drain_timeout){
+        boost::system::error_code ec;
+        handoff_acceptor_->close(ec);
+
+        draining_ = true;
+
+        if(admission.enabled())
+            gate().flush();
+
+        for(auto const & acceptor : acceptors_){
+            if(!acceptor->is_open())
+                continue;
+
+            if(!handoff::send_record(channel.native_handle(), "l", acceptor->native_handle(), ec))
+                logging::fail(ec, "handoff");
+
+            // the successor accepts on it from now on
+            boost::system::error_code ec_;
+            acceptor->close(ec_);
+        }
+
+        close_listeners();
+
+        std::vector<std::weak_ptr<session<true>>> sessions;
+        {
+            std::lock_guard<std::mutex> lock{sessions_mutex_};
+            sessions.swap(sessions_);
+        }
+
+        auto const state = std::make_shared<handoff_state>(std::move(channel), std::move(sessions),
+                                                           min_idle, drain_timeout);
+
+        if(state->sessions.empty())
+            return finish_handoff(state);
+
+        if(!handoff::sessions)
+            logging::warning(boost::asio::error::operation_not_supported,
+                             "handoff: session handoff disabled for this Boost version, sessions are drained");
+
+        for(std::size_t i = 0; i < state->sessions.size(); ++i){
+            auto const s = state->sessions[i].lock();
+            if(!s){
+                if(--state->pending == 0)
+                    finish_handoff(state);
+                continue;
+            }
+
+            boost::asio::dispatch(s->getConnection()->strand(), [this, s, state, i]{
+                s->release_idle(state->min_idle, [this, state, i](int fd, const std::string & record){
+                    if(fd >= 0){
+                        boost::system::error_code ec;
+                        {
+                            std::lock_guard<std::mutex> lock{state->mutex};
+                            handoff::send_record(state->channel.native_handle(), "s " + record, fd, ec);
+                        }
+                        ::close(fd);
+
+                        if(ec)
+                            logging::fail(ec, "handoff");
+
+                        // let go, nothing to drain; only this strand touches the entry
+                        state->sessions[i].reset();
+                    }
+
+                    if(--state->pending == 0)
+                        finish_handoff(state);
+                });
+            });
+        }
+    }
+
+    // Runs on the listen strand: the next connection that asks for it
+    // (handoff::request) gets the handoff, probes are let go
+    void accept_handoff_next(std::chrono::steady_clock::duration min_idle,
+                             std::chrono::steady_clock::duration drain_timeout){
+        using local = boost::asio::local::stream_protocol;
+
+        if(!handoff_acceptor_->is_open())
+            return;
+
+        handoff_acceptor_->async_accept(
+                    boost::asio::bind_executor(
+                        listen_strand(),
+                        [this, min_idle, drain_timeout](const boost::system::error_code & ec,
+                                                        local::socket channel){
+            if(ec == boost::asio::error::operation_aborted)
+                return;
+
+            if(ec)
+                return logging::fail(ec, "accept handoff");
+
+            struct peer{
+                local::socket channel;
+                char request;
+            };
+            auto const p = std::make_shared<peer>(peer{std::move(channel), 0});
+
+            boost::asio::async_read(
+                        p->channel, boost::asio::buffer(&p->request, 1),
+                        boost::asio::bind_executor(
+                            listen_strand(),
+                            [this, p, min_idle, drain_timeout](const boost::system::error_code & ec, std::size_t){
+                if(ec || p->request != handoff::request)
+                    return accept_handoff_next(min_idle, drain_timeout);
+
+                hand_off(std::move(p->channel), min_idle, drain_timeout);
+            }));
+        }));
+    }
+
+    void finish_handoff(const std::shared_ptr<handoff_state> & state){
+        // end of the inheritance
+        boost::system::error_code ec;
+        state->channel.close(ec);
+
+        // sessions that were not idle close the usual way
+        std::vector<std::weak_ptr<session<true>>> busy;
+        for(auto & p : state->sessions)
+            if(!p.expired())
+                busy.push_back(std::move(p));
+
+        drain_sessions(std::move(busy), state->drain_timeout, 1000, {});
+    }
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+
+    void drain_sessions(std::vector<std::weak_ptr<session<true>>> && sessions,
+                        std::chrono::steady_clock::duration timeout,
+                        double closes_per_second,
+                        std::function<void()> on_drained){
+        auto const rate = closes_per_second > 0 ? closes_per_second : 1000;
+
+        auto const state = std::make_shared<drain_state>(drain_state{
+            boost::asio::steady_timer{http::base::processor::get().io_service()},
+            std::move(sessions),
+            0,
+            base::token_bucket{rate_limit{rate, (std::max)(1.0, rate / 100)}},
+            std::chrono::steady_clock::now() + timeout,
+            std::move(on_drained)});
+
+        drain_step(state);
+    }
+
+    void drain_step(const std::shared_ptr<drain_state> & state){
+        auto const now = std::chrono::steady_clock::now();
+
+        // close frames at the configured rate, each after the session's queue
+        while(state->next < state->sessions.size() && state->closes.wait(now) == std::chrono::steady_clock::duration::zero()){
+            state->closes.consume(1, now);
+
+            if(auto const s = state->sessions[state->next].lock())
+                boost::asio::dispatch(s->getConnection()->strand(), [s]{
+                    s->do_close_when_flushed(boost::beast::websocket::close_code::going_away);
+                });
+
+            ++state->next;
+        }
+
+        bool const done = state->next == state->sessions.size()
+                && std::all_of(state->sessions.begin(), state->sessions.end(),
+                               [](const std::weak_ptr<ws::session<true>> & p){
+            auto const s = p.lock();
+            return !s || s->finished();
+        });
+
+        if(!done && now < state->deadline){
+            state->timer.expires_after(std::chrono::milliseconds(10));
+            state->timer.async_wait([this, state](const boost::system::error_code & ec){
+                if(!ec)
+                    drain_step(state);
+            });
+            return;
+        }
+
+        // deadline, drop whatever is left
+        for(auto const & p : state->sessions)
+            if(auto const s = p.lock())
+                boost::asio::dispatch(s->getConnection()->strand(), [s]{
+                    boost::system::error_code ec;
+                    s->getConnection()->stream().next_layer().close(ec);
+                });
+
+        if(state->on_drained)
+            state->on_drained();
+        else
+            http::base::processor::get().stop();
+    }
+
+    template<class Callback>
+    void start_session(session<true> & session, Callback & on_done){
+        // drain() took the session list before this one was in it
+        if(draining_.load()){
+            session.do_close_when_flushed(boost::beast::websocket::close_code::going_away);
+            return;
+        }
+
+        on_done(session);
+    }
+
+    // `waited`: the handshake gate let the upgrade through on its timer
+    template<class Callback>
+    void make_session(boost::asio::ip::tcp::socket&& socket,
+                      boost::beast::flat_buffer&& buffer,
+                      base::handshake_gate::ticket&& ticket,
+                      Callback && on_done,
+                      bool waited = false){
+        session<true>::make(std::move(socket),
+                            std::move(buffer),
+                            options,
+                            decorator_,
+                            on_accept,
+                            on_message,
+                            on_ping,
+                            on_pong,
+                            on_close,
+                            on_slow_consumer,
+                            [this, &ticket, &on_done, waited](session<true> & session){
+            session.hold(std::move(ticket));
+            track(session);
+
+            if(!waited)
+                return start_session(session, on_done);
+
+            // off the gate's timer, onto the strand of the session
+            boost::asio::dispatch(session.getConnection()->strand(),
+                                  [this, self = session.shared_from_this(), on_done]() mutable {
+                start_session(*self, on_done);
+            });
+        });
+    }
+
+    // Admission control runs before any session state is allocated. `make`
+    // gets the socket, the bytes read past the upgrade request, the ticket
+    // of the gate and whether the upgrade waited for it
+    template<class Make>
+    void enter(boost::asio::ip::tcp::socket&& socket,
+               boost::beast::flat_buffer&& buffer,
+               Make && make){
+        if(draining_.load(std::memory_order_relaxed))
+            return reject(std::move(socket));
+
+        if(!admission.enabled())
+            return make(std::move(socket), std::move(buffer), base::handshake_gate::ticket{}, false);
+
+        boost::system::error_code ec;
+        auto const address = socket.remote_endpoint(ec).address();
+        if(ec)
+            return;
+
+        using state_type = std::tuple<boost::asio::ip::tcp::socket,
+                                      boost::beast::flat_buffer,
+                                      typename std::decay<Make>::type>;
+
+        auto const state = std::make_shared<state_type>(std::move(socket), std::move(buffer),
+                                                        std::forward<Make>(make));
+
+        gate().enter(address, [this, state](base::handshake_gate::ticket ticket, bool waited){
+            // drain() started while it waited
+            if(!ticket || draining_.load(std::memory_order_relaxed))
+                return reject(std::move(std::get<0>(*state)));
+
+            std::get<2>(*state)(std::move(std::get<0>(*state)), std::move(std::get<1>(*state)),
+                                std::move(ticket), waited);
+        });
+    }
+
+    template<class Callback>
+    void admit(boost::asio::ip::tcp::socket&& socket,
+               boost::beast::flat_buffer&& buffer,
+               Callback && on_done){
+        enter(std::move(socket), std::move(buffer),
+              [this, on_done = std::forward<Callback>(on_done)](boost::asio::ip::tcp::socket&& socket,
+                                                                 boost::beast::flat_buffer&& buffer,
+                                                                 base::handshake_gate::ticket&& ticket,
+                                                                 bool waited) mutable {
+            make_session(std::move(socket), std::move(buffer), std::move(ticket), on_done, waited);
+        });
+    }
+
+    template<class Spawn>
+    void admit_coro(boost::asio::ip::tcp::socket&& socket,
+                    boost::beast::flat_buffer&& buffer,
+                    Spawn && spawn){
+        enter(std::move(socket), std::move(buffer),
+              [this, spawn = std::forward<Spawn>(spawn)](boost::asio::ip::tcp::socket&& socket,
+                                                          boost::beast::flat_buffer&& buffer,
+                                                          base::handshake_gate::ticket&& ticket,
+                                                          bool waited) mutable {
+            auto const session = coro::session::make(std::move(socket), std::move(buffer),
+                                                     options, decorator_);
+            session->hold(std::move(ticket));
+
+            if(!waited)
+                return spawn(session);
+
+            // off the gate's timer, onto the strand of the session
+            boost::asio::dispatch(session->get_executor(), [session, spawn]() mutable {
+                spawn(session);
+            });
+        });
+    }
+
+    // Cheap refusal, no session and no parsing
+    void reject(boost::asio::ip::tcp::socket&& socket){
+        boost::system::error_code ec;
+
+        if(admission.abortive_reject){
+            socket.set_option(boost::asio::socket_base::linger(true, 0), ec);
+            socket.close(ec);
+            return;
+        }
+
+        static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                        "Retry-After: 5\r\n"
+                                        "Content-Length: 0\r\n"
+                                        "Connection: close\r\n\r\n";
+
+        auto const socket_p = std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket));
+        boost::asio::async_write(*socket_p, boost::asio::buffer(response, sizeof(response) - 1),
+                                 [socket_p](const boost::system::error_code &, std::size_t){
+            boost::system::error_code ec;
+            socket_p->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+            socket_p->close(ec);
+        });
+    }
+
 public:
 
-    std::function<void(session<true>&, boost::beast::multi_buffer&)> on_accept;
-    std::function<void(session<true>&, const boost::beast::multi_buffer&, boost::beast::multi_buffer&)> on_message;
+    std::function<void(session<true>&, multi_buffer&)> on_accept;
+    std::function<void(session<true>&, const multi_buffer&, multi_buffer&)> on_message;
     std::function<void(session<true>&, const boost::beast::string_view&)> on_ping;
     std::function<void(session<true>&, const boost::beast::string_view&)> on_pong;
     std::function<void(session<true>&, const boost::beast::string_view&)> on_close;
+    // The slow consumer policy of options acted on a session (queued bytes)
+    std::function<void(session<true>&, std::size_t)> on_slow_consumer;
+
+    session_options options;
+
+    // Upgrade rate and per-address limits. Set before the first upgrade
+    handshake_options admission;
+
+    /// \brief Admission counters, null until the first limited upgrade
+    const base::handshake_gate::counters* admission_stats(){
+        return gate_ ? &gate_->stats() : nullptr;
+    }
 
     explicit server_impl()
     {}
@@ -28,14 +598,203 @@ public:
 
     template<class ConnectionPtr, class Callback>
     void upgrade_session(const ConnectionPtr& connection, Callback && on_done){
-        session<true>::template make<Callback>(connection->release_stream(),
-                                                        decorator_,
-                                                        on_accept,
-                                                        on_message,
-                                                        on_ping,
-                                                        on_pong,
-                                                        on_close,
-                                                        std::forward<Callback>(on_done));
+        admit(connection->release_stream(), boost::beast::flat_buffer{}, std::forward<Callback>(on_done));
+    }
+
+    /// \brief Upgrade with the bytes the HTTP layer has already read past
+    /// the upgrade request (its read buffer). Those bytes are handed over to
+    /// the WebSocket stream, so a first frame sent in the same packet as the
+    /// handshake is not lost.
+    template<class ConnectionPtr, class ConstBufferSequence, class Callback>
+    void upgrade_session(const ConnectionPtr& connection, const ConstBufferSequence& buffered, Callback && on_done){
+        boost::beast::flat_buffer buffer;
+        buffer.commit(boost::asio::buffer_copy(buffer.prepare(boost::asio::buffer_size(buffered)), buffered));
+
+        admit(connection->release_stream(), std::move(buffer), std::forward<Callback>(on_done));
+    }
+
+    /// \brief Upgrade into a coroutine session (coro.hpp), admitted like
+    /// upgrade_session. `spawn` gets the coro::session::ptr and starts its
+    /// coroutine on session->get_executor(), beginning with accept(req).
+    /// The session applies the decorator and the read_message_max and socket
+    /// options; drain() does not close it.
+    template<class ConnectionPtr, class Spawn>
+    void upgrade_coro(const ConnectionPtr& connection, Spawn && spawn){
+        admit_coro(connection->release_stream(), boost::beast::flat_buffer{}, std::forward<Spawn>(spawn));
+    }
+
+    template<class ConnectionPtr, class ConstBufferSequence, class Spawn>
+    void upgrade_coro(const ConnectionPtr& connection, const ConstBufferSequence& buffered, Spawn && spawn){
+        boost::beast::flat_buffer buffer;
+        buffer.commit(boost::asio::buffer_copy(buffer.prepare(boost::asio::buffer_size(buffered)), buffered));
+
+        admit_coro(connection->release_stream(), std::move(buffer), std::forward<Spawn>(spawn));
+    }
+
+    /// \brief Shut down without cutting sessions off mid-write
+    /// New upgrades are refused. Each session is asked to close once its
+    /// queued output is written, at most `closes_per_second` of them per
+    /// second, so clients do not all reconnect at the same moment. Once
+    /// every session is closed, or at the deadline (remaining connections
+    /// are dropped), `on_drained` runs; by default it stops the processor.
+    /// The listening sockets of listen() are closed first. Listeners of the
+    /// HTTP server are not stopped: it answers the upgrades with 503.
+    /// \param Time to wait for the sessions
+    /// \param Close frames per second
+    /// \param Called once drained
+    void drain(std::chrono::steady_clock::duration timeout,
+               double closes_per_second = 1000,
+               std::function<void()> on_drained = {}){
+        if(draining_.exchange(true))
+            return;
+
+        boost::asio::dispatch(listen_strand(), [this]{
+            close_listeners();
+        });
+
+        // upgrades waiting for the gate are turned away now
+        if(admission.enabled())
+            gate().flush();
+
+        std::vector<std::weak_ptr<session<true>>> sessions;
+        {
+            std::lock_guard<std::mutex> lock{sessions_mutex_};
+            sessions.swap(sessions_);
+        }
+
+        drain_sessions(std::move(sessions), timeout, closes_per_second, std::move(on_drained));
+    }
+
+    bool draining() const{
+        return draining_.load(std::memory_order_relaxed);
+    }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    /// \brief Accept WebSocket clients directly, on a listening socket that
+    /// can be handed over to the next process (see accept_handoff)
+    /// The socket is taken from `inherited` if the previous process handed
+    /// one over for this address, otherwise it is bound.
+    /// \param Listening interface
+    /// \param port
+    /// \param Route table. A handler typically calls session.do_accept(req)
+    /// \param What the previous process handed over
+    void listen(const std::string & address, uint32_t port, const path_table & routes,
+                handoff::inheritance & inherited){
+        boost::system::error_code ec;
+        boost::asio::ip::tcp::endpoint const endpoint{boost::asio::ip::make_address(address, ec),
+                                                      static_cast<unsigned short>(port)};
+        if(ec)
+            return logging::fail(ec, "listen");
+
+        auto acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(http::base::processor::get().io_service());
+
+        int const fd = inherited.take_listener(endpoint);
+        if(fd >= 0){
+            acceptor->assign(endpoint.protocol(), fd, ec);
+            if(ec)
+                ::close(fd);
+        }
+        else
+            bind(*acceptor, endpoint, ec);
+
+        if(ec)
+            return logging::fail(ec, "listen");
+
+        accept_next(*acceptor, std::make_shared<const path_table>(routes));
+        acceptors_.push_back(std::move(acceptor));
+    }
+
+    /// \brief Open the sessions handed over by the previous process
+    /// The routes and on_accept are not involved, the peers are past the
+    /// upgrade. Messages go to on_message as usual.
+    /// \param What the previous process handed over
+    /// \param Called with each adopted session (e.g. to launch its timer)
+    template<class Callback>
+    void adopt(handoff::inheritance & inherited, Callback && on_adopt){
+        for(auto & s : inherited.take_sessions()){
+            boost::asio::ip::tcp::socket socket{http::base::processor::get().io_service()};
+
+            boost::system::error_code ec;
+            socket.assign(s.endpoint.protocol(), s.fd, ec);
+            if(ec){
+                ::close(s.fd);
+                logging::fail(ec, "adopt");
+                continue;
+            }
+
+            make_session(std::move(socket), boost::beast::flat_buffer{}, {},
+                         [&s, &on_adopt](session<true> & session){
+                if(session.do_adopt(s.text, s.target))
+                    on_adopt(session);
+            });
+        }
+    }
+
+    /// \brief Hand this process over to its successor on request
+    /// The next process connects to `path` (handoff::inheritance) and gets
+    /// the listening sockets of listen(..., inherited) and every session
+    /// idle for `min_idle`, with no close and no reconnect on the wire.
+    /// The remaining sessions are drained (see drain()), then the
+    /// processor stops. The socket file is made private to the user; one
+    /// left behind is replaced, one another process accepts on is not.
+    /// \param Unix socket path
+    /// \param Minimum time since the last message of a handed over session
+    /// \param Time to wait for the sessions that were not idle
+    void accept_handoff(const std::string & path,
+                        std::chrono::steady_clock::duration min_idle = std::chrono::seconds(1),
+                        std::chrono::steady_clock::duration drain_timeout = std::chrono::seconds(10)){
+        using local = boost::asio::local::stream_protocol;
+
+        // a socket file nobody accepts on is left by the predecessor
+        boost::system::error_code ec;
+        if(handoff::accepting(path, ec))
+            ec = boost::asio::error::address_in_use;
+        else if(!ec && ::unlink(path.c_str()) != 0 && errno != ENOENT)
+            ec.assign(errno, boost::system::system_category());
+
+        if(ec)
+            return logging::fail(ec, "accept handoff");
+
+        handoff_acceptor_ = std::make_unique<local::acceptor>(http::base::processor::get().io_service());
+
+        handoff_acceptor_->open(local{}, ec);
+        if(!ec)
+            handoff_acceptor_->bind(local::endpoint{path}, ec);
+        if(!ec && ::chmod(path.c_str(), 0600) != 0)
+            ec.assign(errno, boost::system::system_category());
+        if(!ec)
+            handoff_acceptor_->listen(1, ec);
+
+        if(ec)
+            return logging::fail(ec, "accept handoff");
+
+        accept_handoff_next(min_idle, drain_timeout);
+    }
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+
+    /// \brief Accept WebSocket clients directly, without an HTTP server
+    /// Only the upgrade request is parsed, into the buffer the session keeps
+    /// for the handshake, and it is routed by an exact match of its target.
+    /// Unknown targets and non-upgrade requests get a bodiless 404/400.
+    /// \param Listening interface
+    /// \param port
+    /// \param Route table. A handler typically calls session.do_accept(req)
+    void listen(const std::string & address, uint32_t port, const path_table & routes){
+        boost::system::error_code ec;
+        boost::asio::ip::tcp::endpoint const endpoint{boost::asio::ip::make_address(address, ec),
+                                                      static_cast<unsigned short>(port)};
+        if(!ec){
+            auto acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(http::base::processor::get().io_service());
+            bind(*acceptor, endpoint, ec);
+
+            if(!ec){
+                accept_next(*acceptor, std::make_shared<const path_table>(routes));
+                listeners_.push_back(std::move(acceptor));
+            }
+        }
+
+        if(ec)
+            logging::fail(ec, "listen");
     }
 
 }; // server_impl class
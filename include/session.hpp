@@ -2,11 +2,120 @@
 #define BEAST_WS_SESSION_HPP
 
 #include "base.hpp"
+#include "handoff.hpp"
+#include "latency.hpp"
+#include "limits.hpp"
+#include "pool.hpp"
+#include "queue.hpp"
+#include "shared_message.hpp"
+#include "work_pool.hpp"
+#include "zerocopy.hpp"
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 namespace ws {
 
 using message_t = boost::beast::string_view;
 
+/// \brief What a server session does when its peer does not keep up
+enum class slow_consumer_policy{
+    // queue without bound
+    none,
+    // drop the oldest queued messages to stay under max_queued_bytes
+    drop_oldest,
+    // drop a new message that would exceed max_queued_bytes
+    drop_newest,
+    // close the connection past max_queued_bytes or max_lag
+    disconnect
+};
+
+/// \brief Slow consumer counters, summed over all sessions
+struct slow_consumer_counters{
+    std::atomic<std::uint64_t> dropped_messages{0};
+    std::atomic<std::uint64_t> dropped_bytes{0};
+    std::atomic<std::uint64_t> disconnects{0};
+    // replaced by a newer message with the same key (send_latest)
+    std::atomic<std::uint64_t> conflated_messages{0};
+};
+
+inline slow_consumer_counters & slow_consumer_stats(){
+    static slow_consumer_counters instance;
+    return instance;
+}
+
+/// \brief Settings shared by all sessions of a server
+struct session_options{
+
+    // Release the io buffers of a session idle for this long. Checked when
+    // the session timer expires, zero disables hibernation. A hibernated
+    // session waits for the next message with a one byte read, so it holds
+    // no prepared input buffer. It stays hibernated while its messages are
+    // at least this far apart and reads the usual way once they come closer.
+    std::chrono::steady_clock::duration hibernate_after = std::chrono::steady_clock::duration::zero();
+
+    // Weights of the data lanes of send(message, lane), at most
+    // base::outbound_queue<>::max_lanes. Lanes share the link by deficit
+    // round robin over message bytes; control frames always go first.
+    std::vector<unsigned> lane_weights = {1};
+
+    // Messages larger than this are written as several frames, so queued
+    // control frames are not held up behind them. Zero writes every message
+    // as a single frame.
+    std::size_t fragment_size = 64 * 1024;
+
+    // Outbound backlog limits of a session, zero is unlimited. The lag is
+    // the age of the oldest unsent message, only checked by disconnect.
+    slow_consumer_policy slow_consumer = slow_consumer_policy::none;
+    std::size_t max_queued_bytes = 0;
+    std::chrono::steady_clock::duration max_lag = std::chrono::steady_clock::duration::zero();
+
+    // Inbound budget of a session in messages/s and bytes/s. Once spent,
+    // the next read waits until the buckets refill, so the peer is held
+    // back by its TCP window.
+    rate_limit inbound_messages;
+    rate_limit inbound_bytes;
+
+    // Largest message a peer may send, zero keeps the stream default
+    std::uint64_t read_message_max = 0;
+
+    // What a session does while memory_budget is exceeded
+    bool pause_reads_over_budget = true;
+    bool reject_upgrades_over_budget = true;
+    // close the session if it holds more than twice the average
+    bool close_largest_over_budget = false;
+
+    // TCP_NODELAY, TCP_QUICKACK and SO_BUSY_POLL of accepted sockets (see
+    // latency.hpp for the low latency profile)
+    socket_tuning socket;
+
+    // Binary messages of at least this many bytes are sent with
+    // MSG_ZEROCOPY (see zerocopy.hpp), zero sends every message through the
+    // stream. Pays off from about 10 KB; a message is held until the
+    // kernel has sent it.
+    std::size_t zerocopy_threshold = 0;
+
+    // Workers that open and read the files of send_file, it must outlive
+    // the server; base::file_pool() if null. The io threads never wait for
+    // the disk.
+    base::work_pool* file_pool = nullptr;
+
+    // Run on_message on these workers instead of the io thread, it must
+    // outlive the server. A session hands its messages over one at a time,
+    // in order; the handler gets a fresh output buffer and may only reach
+    // the session through session::post. Reading stops while
+    // max_handlers_in_flight messages of a session wait or run.
+    base::work_pool* handler_pool = nullptr;
+    std::size_t max_handlers_in_flight = 16;
+
+    // Messages a session handles in a row when the stream already holds
+    // them, before its next read goes back to the io context (see
+    // read_batch.hpp). Each one nests a handler call, 1 reads one message
+    // per completion.
+    std::size_t read_batch = 16;
+
+};
+
 //###########################################################################
 
 /// \brief session class. Handles an WS server connection
@@ -20,52 +129,105 @@ class session  : private boost::noncopyable,
     bool accepted = false;
     // Auto-detection of incoming frame type
     bool auto_frame = true;
+    // Frame type of the messages send() queues: the one set, or the last
+    // one received
+    bool text_frame = true;
     // Repeated asynchronous reading is impossible!
     bool readable = true;
+    // Waiting for the first byte of a message (see session_options::hibernate_after)
+    bool waking = false;
+    // A read of the stream is in progress
+    bool reading_ = false;
+    // Write operation in progress
+    bool writing = false;
+    // idle, io buffers released: the next message is waited for with the
+    // wake byte (see session_options::hibernate_after)
+    bool hibernated = false;
+    // close once the write queue is empty
+    bool draining = false;
+    boost::beast::websocket::close_reason drain_reason_;
+    // read by the drain of the server
+    std::atomic<bool> finished_{false};
 
     std::function<void(session<true>&)> on_timer_cb;
 
+    const session_options & options_;
+
     const std::function<void(boost::beast::websocket::response_type&)> & decorator_cb_;
 
     // user handler events
-    const std::function<void(session<true>&, boost::beast::multi_buffer&)> & on_accept_cb_;
-    const std::function<void(session<true>&, const boost::beast::multi_buffer&, boost::beast::multi_buffer&)> & on_message_cb_;
+    const std::function<void(session<true>&, multi_buffer&)> & on_accept_cb_;
+    const std::function<void(session<true>&, const multi_buffer&, multi_buffer&)> & on_message_cb_;
     const std::function<void(session<true>&, const boost::beast::string_view&)> & on_ping_cb_;
     const std::function<void(session<true>&, const boost::beast::string_view&)> & on_pong_cb_;
     const std::function<void(session<true>&, const boost::beast::string_view&)> & on_close_cb_;
+    // called with the queued bytes when the slow consumer policy acts
+    const std::function<void(session<true>&, std::size_t)> & on_slow_consumer_cb_;
 
 public:
 
+    using buffer_type = multi_buffer;
+
     explicit session(boost::asio::ip::tcp::socket&& socket,
+                     boost::beast::flat_buffer&& buffer,
+                     const session_options & options,
                      const std::function<void(boost::beast::websocket::response_type&)> & decorator_cb,
-                     const std::function<void(session<true>&, boost::beast::multi_buffer&)> & on_accept_cb,
-                     const std::function<void(session<true>&, const boost::beast::multi_buffer&, boost::beast::multi_buffer&)> & on_message_cb,
+                     const std::function<void(session<true>&, multi_buffer&)> & on_accept_cb,
+                     const std::function<void(session<true>&, const multi_buffer&, multi_buffer&)> & on_message_cb,
                      const std::function<void(session<true>&, const boost::beast::string_view&)> & on_ping_cb,
                      const std::function<void(session<true>&, const boost::beast::string_view&)> & on_pong_cb,
-                     const std::function<void(session<true>&, const boost::beast::string_view&)> & on_close_cb)
-        : timer_p_{std::make_shared<http::base::timer>(socket.get_executor(),
-                                                       (std::chrono::steady_clock::time_point::max)())},
+                     const std::function<void(session<true>&, const boost::beast::string_view&)> & on_close_cb,
+                     const std::function<void(session<true>&, std::size_t)> & on_slow_consumer_cb)
+        : options_{options},
           decorator_cb_{decorator_cb},
           on_accept_cb_{on_accept_cb},
           on_message_cb_{on_message_cb},
           on_ping_cb_{on_ping_cb},
           on_pong_cb_{on_pong_cb},
           on_close_cb_{on_close_cb},
-          connection_p_{std::make_shared<base::connection>(std::move(socket))}
-    {}
+          on_slow_consumer_cb_{on_slow_consumer_cb},
+          timer_{socket.get_executor(), (std::chrono::steady_clock::time_point::max)()},
+          connection_{std::move(socket)},
+          handshake_buffer_{std::move(buffer)},
+          message_bucket_{options.inbound_messages},
+          byte_bucket_{options.inbound_bytes}
+    {
+        write_queue_.configure(options_.lane_weights,
+                               options_.fragment_size > 0 ? options_.fragment_size : 64 * 1024);
+
+        if(options_.read_message_max > 0)
+            connection_.stream().read_message_max(options_.read_message_max);
+
+        if(options_.socket.enabled())
+            base::tune_socket(connection_.stream().next_layer(), options_.socket);
+
+        if(options_.zerocopy_threshold > 0)
+            zerocopy_.enable(connection_.stream().next_layer());
+
+        memory_budget::get().open_session();
+    }
+
+    ~session(){
+        memory_budget::get().close_session();
+    }
 
     template<class Callback>
     static void make(boost::asio::ip::tcp::socket&& socket,
+                     boost::beast::flat_buffer&& buffer,
+                     const session_options & options,
                      const std::function<void(boost::beast::websocket::response_type&)> & decorator_cb,
-                     const std::function<void(session<true>&, boost::beast::multi_buffer&)> & on_accept_cb,
-                     const std::function<void(session<true>&, const boost::beast::multi_buffer&, boost::beast::multi_buffer&)> & on_message_cb,
+                     const std::function<void(session<true>&, multi_buffer&)> & on_accept_cb,
+                     const std::function<void(session<true>&, const multi_buffer&, multi_buffer&)> & on_message_cb,
                      const std::function<void(session<true>&, const boost::beast::string_view&)> & on_ping_cb,
                      const std::function<void(session<true>&, const boost::beast::string_view&)> & on_pong_cb,
                      const std::function<void(session<true>&, const boost::beast::string_view&)> & on_close_cb,
+                     const std::function<void(session<true>&, std::size_t)> & on_slow_consumer_cb,
                      Callback&& on_done)
     {
-        auto new_session_p = std::make_shared<session<true> >
-                (std::move(socket), decorator_cb, on_accept_cb, on_message_cb, on_ping_cb, on_pong_cb, on_close_cb);
+        // session, connection, timer and io buffers come from one pooled block
+        auto new_session_p = std::allocate_shared<session<true> >
+                (base::pool_allocator<session<true> >{},
+                 std::move(socket), std::move(buffer), options, decorator_cb, on_accept_cb, on_message_cb, on_ping_cb, on_pong_cb, on_close_cb, on_slow_consumer_cb);
         on_done(*new_session_p);
     }
 
@@ -76,24 +238,46 @@ public:
         if(accepted)
             return;
 
-        connection_p_->control_callback(
+        if(options_.reject_upgrades_over_budget && memory_budget::get().exceeded()){
+            memory_budget::get().rejected_upgrades.fetch_add(1, std::memory_order_relaxed);
+            return do_reject(boost::beast::http::status::service_unavailable);
+        }
+
+        target_.assign(msg.target().data(), msg.target().size());
+
+        connection_.control_callback(
                     std::bind(
                         &session<true>::on_control_callback,
                         this,
                         std::placeholders::_1,
                         std::placeholders::_2));
 
-        timer_p_->stream().expires_after(std::chrono::seconds(10));
+        timer_.stream().expires_after(std::chrono::seconds(10));
+
+        // The HTTP layer may have read past the upgrade request, e.g. the
+        // first frame of a client that does not wait for the handshake
+        // response. Put the request back in front of those bytes and use
+        // the buffered accept, so the stream parses them from its own
+        // buffer instead of losing them.
+        if(handshake_buffer_.size() > 0){
+            boost::beast::flat_buffer raw;
+            boost::beast::ostream(raw) << msg;
+            raw.commit(boost::asio::buffer_copy(raw.prepare(handshake_buffer_.size()),
+                                                handshake_buffer_.data()));
+            handshake_buffer_ = std::move(raw);
+
+            return do_accept_buffered();
+        }
 
         // Accept the websocket handshake
         if(decorator_cb_){
-            connection_p_->async_accept_ex(msg, decorator_cb_,
+            connection_.async_accept_ex(msg, decorator_cb_,
                                            std::bind(
                                                &session<true>::on_accept,
                                                this->shared_from_this(),
                                                std::placeholders::_1));
         }else{
-            connection_p_->async_accept(msg,
+            connection_.async_accept(msg,
                                         std::bind(
                                             &session<true>::on_accept,
                                             this->shared_from_this(),
@@ -101,13 +285,70 @@ public:
         }
     }
 
+    /// \brief Read the upgrade request straight from the socket (standalone
+    /// listener) and hand the session to the handler routed by its target
+    /// \param Route table, kept until the request is routed
+    template<class Routes>
+    void do_read_upgrade(std::shared_ptr<const Routes> routes)
+    {
+        if(accepted)
+            return;
+
+        upgrade_parser_ = std::make_unique<boost::beast::http::request_parser<boost::beast::http::empty_body>>();
+        upgrade_parser_->header_limit(8 * 1024);
+
+        timer_.stream().expires_after(std::chrono::seconds(10));
+        launch_timer();
+
+        connection_.async_read_upgrade(
+                    handshake_buffer_,
+                    *upgrade_parser_,
+                    std::bind(
+                        &session<true>::template on_read_upgrade<Routes>,
+                        this->shared_from_this(),
+                        std::move(routes),
+                        std::placeholders::_1,
+                        std::placeholders::_2));
+    }
+
+    /// \brief Refuse the upgrade with a bodiless HTTP response and close
+    void do_reject(boost::beast::http::status status)
+    {
+        if(accepted)
+            return;
+
+        auto const reason = boost::beast::http::obsolete_reason(status);
+        auto const code = std::to_string(static_cast<unsigned>(status));
+
+        handshake_buffer_.consume(handshake_buffer_.size());
+        boost::beast::ostream(handshake_buffer_)
+                << "HTTP/1.1 " << code << " " << reason << "\r\n"
+                << "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+        connection_.async_write_raw(
+                    handshake_buffer_.data(),
+                    std::bind(
+                        &session<true>::on_reject,
+                        this->shared_from_this(),
+                        std::placeholders::_1,
+                        std::placeholders::_2));
+    }
+
     auto & output(){
         return output_buffer_;
     }
 
-    auto & getConnection() const
+    // The connection lives inside the session object, the returned pointer
+    // shares its ownership
+    base::connection::ptr getConnection()
     {
-        return connection_p_;
+        return shareConnection();
+    }
+
+    /// \brief Pointer to the connection that keeps the session alive
+    base::connection::ptr shareConnection()
+    {
+        return {this->shared_from_this(), &connection_};
     }
 
     void setAutoFrame(){
@@ -116,12 +357,12 @@ public:
 
     void setTextFrame(){
         auto_frame = false;
-        connection_p_->stream().text(true);
+        text_frame = true;
     }
 
     void setBinaryFrame(){
         auto_frame = false;
-        connection_p_->stream().binary(true);
+        text_frame = false;
     }
 
     void do_ping(boost::beast::websocket::ping_data const & payload){
@@ -129,13 +370,13 @@ public:
         if(!accepted)
             return;
 
-        timer_p_->stream().expires_after(std::chrono::seconds(10));
+        timer_.stream().expires_after(std::chrono::seconds(10));
 
-        connection_p_->async_ping(payload,
-                                  std::bind(
-                                      &session<true>::on_ping,
-                                      this->shared_from_this(),
-                                      std::placeholders::_1));
+        // Goes out ahead of queued data, between fragments of a large message
+        write_queue_.push_control(boost::beast::websocket::frame_type::ping, payload);
+
+        if(!writing)
+            write_next();
     }
 
     void do_pong(boost::beast::websocket::ping_data const & payload){
@@ -143,101 +384,896 @@ public:
         if(!accepted)
             return;
 
-        timer_p_->stream().expires_after(std::chrono::seconds(10));
+        timer_.stream().expires_after(std::chrono::seconds(10));
 
-        connection_p_->async_pong(payload,
-                                  std::bind(
-                                      &session<true>::on_pong,
-                                      this->shared_from_this(),
-                                      std::placeholders::_1));
+        // Goes out ahead of queued data, between fragments of a large message
+        write_queue_.push_control(boost::beast::websocket::frame_type::pong, payload);
+
+        if(!writing)
+            write_next();
+    }
+
+    void do_close(boost::beast::websocket::close_reason const & reason){
+
+        if(!accepted)
+            return;
+
+        timer_.stream().expires_after(std::chrono::seconds(10));
+
+        write_queue_.push_close(reason);
+
+        if(!writing)
+            write_next();
+    }
+
+    void launch_timer()
+    {
+        // on the connection strand, like everything else touching the
+        // write queue and the io buffers
+        timer_.stream().async_wait(
+                    boost::asio::bind_executor(
+                        connection_.strand(),
+                        std::bind(
+                            &session<true>::on_timer,
+                            this->shared_from_this(),
+                            std::placeholders::_1)));
+    }
+
+    template<class F>
+    void launch_timer(F&& f){
+
+        on_timer_cb = std::forward<F>(f);
+
+        launch_timer();
+    }
+
+    void do_read(){
+
+        if(!accepted || !readable)
+            return;
+
+        // a raw frame is on its way, read on once it is out
+        if(read_batch_.held)
+            return;
+
+        // the handlers are behind, read on when one completes
+        if(offloaded() && handlers_.size() >= (std::max)(options_.max_handlers_in_flight, std::size_t{1}))
+            return;
+
+        timer_.stream().expires_after(std::chrono::seconds(10));
+
+        readable = false;
+
+        auto & budget = memory_budget::get();
+
+        if(options_.close_largest_over_budget && budget.exceeded() && usage() > 2 * budget.share()){
+            budget.closed_sessions.fetch_add(1, std::memory_order_relaxed);
+            return abort_connection(boost::beast::websocket::close_code::try_again_later);
+        }
+
+        // Over the memory budget, read nothing until memory is released.
+        // Held back by the server, so the idle timer waits as well
+        if(options_.pause_reads_over_budget && budget.exceeded()){
+            budget.paused_reads.fetch_add(1, std::memory_order_relaxed);
+            timer_.stream().expires_at((std::chrono::steady_clock::time_point::max)());
+
+            budget_paused_ = true;
+
+            if(!budget_waiter_){
+                budget_waiter_ = true;
+
+                std::weak_ptr<session<true>> weak = this->shared_from_this();
+                budget.when_under([weak]{
+                    if(auto const self = weak.lock())
+                        boost::asio::post(self->connection_.strand(),
+                                          std::bind(&session<true>::on_budget, self));
+                });
+            }
+
+            // credit other threads hold counts as used until they release
+            // memory again, look again in a while
+            throttle_timer().expires_after(std::chrono::seconds(1));
+            throttle_timer().async_wait(
+                        boost::asio::bind_executor(
+                            connection_.strand(),
+                            std::bind(
+                                &session<true>::on_budget_retry,
+                                this->shared_from_this(),
+                                std::placeholders::_1)));
+            return;
+        }
+
+        // Over the inbound budget, read nothing until it refills
+        auto const now = std::chrono::steady_clock::now();
+        auto const wait = (std::max)(message_bucket_.wait(now), byte_bucket_.wait(now));
+
+        if(wait > std::chrono::steady_clock::duration::zero()){
+            // not idle, held back
+            timer_.stream().expires_after(wait + std::chrono::seconds(10));
+
+            throttle_timer().expires_after(wait);
+            throttle_timer().async_wait(
+                        boost::asio::bind_executor(
+                            connection_.strand(),
+                            std::bind(
+                                &session<true>::on_throttle,
+                                this->shared_from_this(),
+                                std::placeholders::_1)));
+            return;
+        }
+
+        if(hibernated && input_buffer_.size() == 0){
+            // Wait for the next message without a prepared input buffer
+            waking = true;
+            reading_ = true;
+
+            connection_.async_read_some(
+                        boost::asio::buffer(wake_byte_),
+                        read_batch_,
+                        std::bind(
+                            &session<true>::on_wake,
+                            this->shared_from_this(),
+                            std::placeholders::_1,
+                            std::placeholders::_2));
+            return;
+        }
+
+        reading_ = true;
+
+        connection_.async_read(
+                    input_buffer_,
+                    read_batch_,
+                        std::bind(
+                            &session<true>::on_read,
+                            this->shared_from_this(),
+                            std::placeholders::_1,
+                            std::placeholders::_2));
+    }
+
+    void do_write(){
+
+        if(!accepted)
+            return;
+
+        send(std::move(output_buffer_));
+    }
+
+    /// \brief Queue a message behind the ones already being written
+    /// Call on the session strand. Messages of a lane go out in order, one
+    /// write at a time, and reading goes on while they are written.
+    /// \param Message
+    /// \param Data lane (see session_options::lane_weights)
+    void send(multi_buffer&& message, std::size_t lane = 0){
+
+        if(!accepted)
+            return;
+
+        if(!admit(message.size()))
+            return;
+
+        write_queue_.push(std::move(message), text_frame, lane);
+
+        trim();
+
+        if(!writing)
+            write_next();
+    }
+
+    /// \brief Queue a shared message (take_message), no copy is made
+    /// It goes out with the frame type it was made with. Call on the
+    /// session strand, other sessions get it through post.
+    /// \param Message
+    /// \param Data lane (see session_options::lane_weights)
+    void send(const shared_message & message, std::size_t lane = 0){
+
+        if(!accepted || !message)
+            return;
+
+        if(!admit(message.size()))
+            return;
+
+        write_queue_.push_shared(message, lane);
+
+        trim();
+
+        if(!writing)
+            write_next();
+    }
+
+    /// \brief Take the message on_message is handling, without copying
+    /// Its storage moves into the returned message, which this and other
+    /// sessions can send. The input is empty afterwards; the next message
+    /// is read into blocks from the pool. Call from on_message only.
+    shared_message take_message(){
+        if(handled_input_ == nullptr)
+            return {};
+
+        return {std::move(*handled_input_), handled_text_};
+    }
+
+    /// \brief Queue a message that supersedes earlier ones with the same key
+    /// If a message with this key is still waiting, it is replaced in
+    /// place and keeps its position, otherwise this works like send().
+    /// A peer that falls behind gets the latest value of each key instead
+    /// of every update.
+    /// \param Conflation key (e.g. an instrument id)
+    /// \param Message
+    /// \param Data lane of a new message
+    void send_latest(std::uint64_t key, multi_buffer&& message, std::size_t lane = 0){
+
+        if(!accepted)
+            return;
+
+        if(write_queue_.contains(key)){
+            // the policies see what the replacement adds to the queue
+            auto const queued = write_queue_.latest_size(key);
+            if(message.size() > queued && !admit(message.size() - queued))
+                return;
+
+            write_queue_.push_latest(key, std::move(message), text_frame, lane);
+            slow_consumer_stats().conflated_messages.fetch_add(1, std::memory_order_relaxed);
+
+            trim();
+            return;
+        }
+
+        if(!admit(message.size()))
+            return;
+
+        write_queue_.push_latest(key, std::move(message), text_frame, lane);
+
+        trim();
+
+        if(!writing)
+            write_next();
+    }
+
+    /// \brief Close once the queued messages are written (graceful drain)
+    /// Reading goes on, so the close handshake can complete. A session that
+    /// has not been accepted yet is dropped.
+    void do_close_when_flushed(boost::beast::websocket::close_reason const & reason){
+
+        if(!accepted){
+            finished_ = true;
+
+            boost::system::error_code ec;
+            connection_.stream().next_layer().close(ec);
+            return;
+        }
+
+        drain_reason_ = reason;
+        draining = true;
+
+        if(!writing)
+            write_next();
+    }
+
+    /// \brief The connection is closed, or being dropped. Thread safe
+    bool finished() const{
+        return finished_.load(std::memory_order_relaxed);
+    }
+
+    /// \brief Target of the upgrade request
+    const std::string & target() const{
+        return target_;
+    }
+
+    /// \brief Call f(session) on the session strand. Thread safe, for
+    /// handlers running on session_options::handler_pool
+    template<class F>
+    void post(F&& f){
+        boost::asio::post(connection_.strand(),
+                          [self = this->shared_from_this(), f = std::forward<F>(f)]() mutable {
+            f(*self);
+        });
+    }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    /// \brief Take over an open connection handed off by another process
+    /// The session must have been made on that connection (server::adopt).
+    /// The stream is opened without a handshake on the wire: the upgrade
+    /// response goes to a local socket pair, then the connection is put
+    /// back under the stream. Compression is not negotiated.
+    /// \param Frame type of the outgoing messages
+    /// \param Upgrade target the peer connected to
+    /// \return false if the connection could not be taken over
+    bool do_adopt(bool text, const std::string & target){
+
+        if(accepted)
+            return false;
+
+        auto & socket = connection_.stream().next_layer();
+
+        boost::system::error_code ec;
+        auto const protocol = socket.local_endpoint(ec).protocol();
+        if(ec){
+            logging::fail(ec, "adopt");
+            return false;
+        }
+
+        int pair[2];
+        int const fd = ::fcntl(socket.native_handle(), F_DUPFD_CLOEXEC, 0);
+        if(fd < 0 || ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0){
+            if(fd >= 0)
+                ::close(fd);
+            logging::fail(boost::system::error_code{errno, boost::system::system_category()}, "adopt");
+            return false;
+        }
+
+        socket.close(ec);
+        socket.assign(protocol, pair[0], ec);
+
+        boost::beast::websocket::request_type req;
+        req.method(boost::beast::http::verb::get);
+        req.target(target);
+        req.version(11);
+        req.set(boost::beast::http::field::host, "localhost");
+        req.set(boost::beast::http::field::upgrade, "websocket");
+        req.set(boost::beast::http::field::connection, "upgrade");
+        req.set(boost::beast::http::field::sec_websocket_key, "dGhlIHNhbXBsZSBub25jZQ==");
+        req.set(boost::beast::http::field::sec_websocket_version, "13");
+
+        // answered into the pair, the response is dropped with it
+        if(!ec)
+            connection_.stream().accept(req, ec);
+
+        ::close(pair[1]);
+
+        boost::system::error_code ec_;
+        socket.close(ec_);
+        socket.assign(protocol, fd, ec_);
+
+        if(ec || ec_){
+            logging::fail(ec ? ec : ec_, "adopt");
+            return false;
+        }
+
+        target_ = target;
+
+        connection_.control_callback(
+                    std::bind(
+                        &session<true>::on_control_callback,
+                        this,
+                        std::placeholders::_1,
+                        std::placeholders::_2));
+
+        text_frame = text;
+
+        accepted = true;
+        last_activity_ = std::chrono::steady_clock::now();
+        // no io buffers yet, the first message is waited for with the wake byte
+        hibernated = options_.hibernate_after > std::chrono::steady_clock::duration::zero();
+
+        if(readable)
+            do_read();
+
+        return true;
+    }
+
+    /// \brief Detach the connection for handoff to another process
+    /// Only an idle session lets go: between messages, nothing queued,
+    /// nothing received for `min_idle`, and the stream holds no bytes past
+    /// its last frame and writes no pong or close (handoff::stream_quiet).
+    /// The socket is closed and the descriptor handed over once the read in
+    /// progress has ended; bytes the stream took in meanwhile would be lost
+    /// to the next process, then the connection is dropped instead. The
+    /// session ends without a close frame. Call on the session strand.
+    /// \param Minimum time since the last message
+    /// \param Called on the session strand with a descriptor it owns and
+    /// the state the next process needs ("<t|b> <target>"), or with -1 if
+    /// the session does not let go
+    void release_idle(std::chrono::steady_clock::duration min_idle,
+                      std::function<void(int, const std::string&)> on_released){
+
+        if(!accepted || writing || draining || !write_queue_.empty()
+                || zerocopy_.active() || zerocopy_.pending() || file_writer_.active()
+                || !handlers_.empty()
+                || input_buffer_.size() > 0
+                || !connection_.stream().is_message_done()
+                || !handoff::stream_quiet(connection_.stream())
+                || std::chrono::steady_clock::now() - last_activity_ < min_idle)
+            return on_released(-1, {});
+
+        auto & socket = connection_.stream().next_layer();
+
+        int const fd = ::fcntl(socket.native_handle(), F_DUPFD_CLOEXEC, 0);
+        if(fd < 0)
+            return on_released(-1, {});
+
+        release_fd_ = fd;
+        release_state_ = text_frame ? "t " : "b ";
+        release_state_ += target_;
+        on_released_ = std::move(on_released);
+
+        accepted = false;
+
+        // the pending read completes with operation_aborted, the peer sees nothing
+        boost::system::error_code ec;
+        socket.close(ec);
+
+        if(!reading_)
+            finish_release(boost::asio::error::operation_aborted);
+    }
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+
+    /// \brief Keep the admission ticket of the connection while the session lives
+    void hold(base::handshake_gate::ticket&& ticket){
+        ticket_ = std::move(ticket);
+    }
+
+    /// \brief Bytes waiting to be written
+    std::size_t queued_bytes() const{
+        return write_queue_.bytes() + zerocopy_.remaining()
+                + static_cast<std::size_t>(file_writer_.remaining());
+    }
+
+    /// \brief Memory held by the io buffers, write queue, messages waiting
+    /// for the handler pool and zerocopy sends
+    std::size_t usage() const{
+        std::size_t handed = 0;
+        for(auto const & h : handlers_)
+            handed += h.input.capacity();
+
+        return input_buffer_.capacity() + output_buffer_.capacity() + handed
+                + write_queue_.bytes() - write_queue_.file_bytes()
+                + zerocopy_.held();
+    }
+
+    /// \brief Queue part of a file as a binary message
+    /// The file is read when its turn comes, on the file pool (see
+    /// session_options::file_pool). A regular file goes from the page cache
+    /// to the socket, anything else is read a frame at a time and written by
+    /// the stream. A path
+    /// is opened there as well; one that can not be opened is logged and
+    /// skipped, and it only counts for max_queued_bytes from then on. Call
+    /// on the session strand.
+    /// \param Path, or descriptor the caller keeps
+    /// \param First byte
+    /// \param Bytes from there, base::file_range::to_end for the rest of the file
+    /// \param Data lane (see session_options::lane_weights)
+    /// \return false if the file can not be sent
+    template<class File>
+    bool send_file(const File & file, std::uint64_t offset = 0,
+                   std::uint64_t length = base::file_range::to_end, std::size_t lane = 0){
+
+        if(!accepted)
+            return false;
+
+        boost::system::error_code ec;
+        auto range = prepare_file(file, offset, length, ec);
+        if(ec){
+            logging::fail(ec, "send_file");
+            return false;
+        }
+
+        if(!admit(static_cast<std::size_t>(range.length))){
+            range.close();
+            return false;
+        }
+
+        sendfile_stats().files.fetch_add(1, std::memory_order_relaxed);
+
+        write_queue_.push_file(std::move(range), lane);
+
+        trim();
+
+        if(!writing)
+            write_next();
+
+        return true;
+    }
+
+    void send(boost::beast::string_view message, std::size_t lane = 0){
+        multi_buffer buffer;
+        buffer.commit(boost::asio::buffer_copy(buffer.prepare(message.size()),
+                                               boost::asio::buffer(message.data(), message.size())));
+        send(std::move(buffer), lane);
+    }
+
+    /// \brief Release the io buffers of an idle session
+    /// The input buffer is only released between messages, the output
+    /// buffer only while no write is in progress. Both grow back (from the
+    /// pool) with the next message. Reads after the one in progress wait
+    /// for the first byte of a message before taking an input buffer.
+    void hibernate(){
+
+        if(!accepted)
+            return;
+
+        if(!writing && output_buffer_.size() == 0)
+            output_buffer_ = multi_buffer{};
+
+        if((readable || waking) && input_buffer_.size() == 0)
+            input_buffer_ = multi_buffer{};
+
+        hibernated = true;
+    }
+
+protected:
+
+    // Apply the drop_newest and disconnect policies to a new message
+    bool admit(std::size_t size){
+        auto const limit = options_.max_queued_bytes;
+        auto const over = limit > 0 && write_queue_.bytes() + size > limit;
+
+        if(options_.slow_consumer == slow_consumer_policy::drop_newest && over){
+            slow_consumer_stats().dropped_messages.fetch_add(1, std::memory_order_relaxed);
+            slow_consumer_stats().dropped_bytes.fetch_add(size, std::memory_order_relaxed);
+
+            if(on_slow_consumer_cb_)
+                on_slow_consumer_cb_(*this, write_queue_.bytes());
+            return false;
+        }
+
+        if(options_.slow_consumer == slow_consumer_policy::disconnect && (over || lagging())){
+            disconnect_slow_consumer();
+            return false;
+        }
+
+        return true;
+    }
+
+    // Apply the drop_oldest policy after a new message
+    void trim(){
+        if(options_.slow_consumer != slow_consumer_policy::drop_oldest || options_.max_queued_bytes == 0)
+            return;
+
+        std::size_t dropped = 0;
+        bool acted = false;
+
+        while(write_queue_.bytes() > options_.max_queued_bytes && write_queue_.drop_oldest(dropped)){
+            slow_consumer_stats().dropped_messages.fetch_add(1, std::memory_order_relaxed);
+            slow_consumer_stats().dropped_bytes.fetch_add(dropped, std::memory_order_relaxed);
+            acted = true;
+        }
+
+        if(acted && on_slow_consumer_cb_)
+            on_slow_consumer_cb_(*this, write_queue_.bytes());
+    }
+
+    bool lagging() const{
+        return options_.max_lag > std::chrono::steady_clock::duration::zero()
+                && write_queue_.size() > 0
+                && std::chrono::steady_clock::now() - write_queue_.oldest() > options_.max_lag;
+    }
+
+    void disconnect_slow_consumer(){
+        slow_consumer_stats().disconnects.fetch_add(1, std::memory_order_relaxed);
+
+        if(on_slow_consumer_cb_)
+            on_slow_consumer_cb_(*this, write_queue_.bytes());
+
+        abort_connection(boost::beast::websocket::close_code::policy_error);
+    }
+
+    // A close frame could wait behind the backlog, drop the connection.
+    // Queued data is released, nothing more is queued
+    void abort_connection(boost::beast::websocket::close_reason const & reason){
+        write_queue_.push_close(reason);
+        accepted = false;
+        finished_ = true;
+
+        boost::system::error_code ec;
+        connection_.stream().next_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        connection_.stream().next_layer().close(ec);
+    }
+
+    // One frame at a time: queued control frames first, then the next
+    // fragment of the current message
+    void write_next(){
+
+        if(write_queue_.has_control()){
+            writing = true;
+
+            auto const control = write_queue_.pop_control();
+
+            if(control.kind == boost::beast::websocket::frame_type::ping)
+                connection_.async_ping(control.payload,
+                                       std::bind(
+                                           &session<true>::on_ping,
+                                           this->shared_from_this(),
+                                           std::placeholders::_1));
+            else
+                connection_.async_pong(control.payload,
+                                       std::bind(
+                                           &session<true>::on_pong,
+                                           this->shared_from_this(),
+                                           std::placeholders::_1));
+            return;
+        }
+
+        if(write_queue_.has_close()){
+            writing = true;
+
+            connection_.async_close(write_queue_.close_reason(),
+                                    std::bind(
+                                        &session<true>::on_close,
+                                        this->shared_from_this(),
+                                        std::placeholders::_1));
+            return;
+        }
+
+        if(zerocopy_.active() || file_writer_.active())
+            return raw_next();
+
+        auto const message = write_queue_.current();
+        if(message == nullptr){
+            writing = false;
+
+            // everything is written, close as asked by do_close_when_flushed
+            if(draining){
+                draining = false;
+                do_close(drain_reason_);
+            }
+            return;
+        }
+
+        auto const file = message->file.fd >= 0;
+
+        if(message->file.is_deferred())
+            return open_file(message->file);
+
+        // large binary messages and files bypass the stream
+        if(file && !message->started && message->file.direct && message->file.length > 0){
+            boost::system::error_code ec;
+            if(!file_writer_.start(write_queue_.release_file(), ec)){
+                writing = false;
+                logging::fail(ec, "send_file");
+                return abort_connection(boost::beast::websocket::close_code::internal_error);
+            }
+            return raw_next();
+        }
+
+        if(!file && !message->started && !message->text && zerocopy_.enabled()
+                && message->data.size() >= options_.zerocopy_threshold){
+            zerocopy_.start(write_queue_.release_current());
+            return raw_next();
+        }
+
+        auto const chunk = options_.fragment_size > 0 ? options_.fragment_size : 64 * 1024;
+
+        // the next frame of a file the stream writes
+        if(file && message->data.size() == 0 && message->file.length > 0)
+            return read_file(message->file, chunk);
+
+        writing = true;
+
+        auto const size = message->buffered();
+        auto const n = options_.fragment_size > 0 ? (std::min)(size, options_.fragment_size) : size;
+
+        // the frame type of a message is set by its first frame
+        if(!message->started){
+            message->started = true;
+            connection_.stream().text(message->text);
+        }
+
+        connection_.async_write_some(
+            n == size && message->file.length == 0,
+            boost::beast::buffers_prefix(n, message->pending()),
+                std::bind(
+                    &session<true>::on_write,
+                    this->shared_from_this(),
+                    std::placeholders::_1,
+                    std::placeholders::_2));
+    }
+
+    // Next frame of the current zerocopy message or file. The stream
+    // writes an empty frame first (see raw_frame.hpp), the raw frame
+    // follows when it is out
+    void raw_next(){
+
+        writing = true;
+
+        // a frame of a file is in its pipe before anything is written
+        if(file_writer_.needs_fill())
+            return fill_file();
+
+        connection_.stream().text(false);
+        connection_.async_write_some(
+                    false, boost::asio::const_buffer{},
+                    std::bind(
+                        &session<true>::on_raw_ready,
+                        this->shared_from_this(),
+                        std::placeholders::_1,
+                        std::placeholders::_2));
+    }
+
+    // The raw frame, as far as the socket takes it; the reads are held
+    void write_raw(){
+
+        boost::system::error_code ec;
+        auto const status = zerocopy_.active()
+                ? zerocopy_.write_frame(options_.fragment_size, ec)
+                : file_writer_.write_frame(connection_.stream().next_layer(), ec);
+
+        using status_t = base::frame_status;
+
+        if(status == status_t::would_block){
+            connection_.async_wait_raw(
+                        boost::asio::socket_base::wait_write,
+                        std::bind(
+                            &session<true>::on_raw_writable,
+                            this->shared_from_this(),
+                            std::placeholders::_1));
+            return;
+        }
+
+        release_reads();
+
+        if(status == status_t::failed){
+            writing = false;
+            logging::fail(ec, "raw write");
+            return abort_connection(boost::beast::websocket::close_code::internal_error);
+        }
+
+        last_activity_ = std::chrono::steady_clock::now();
+        watch_zerocopy();
+
+        // control frames go between two frames
+        if(status == status_t::frame_done)
+            return write_next();
+
+        // the stream ends the message it opened
+        connection_.async_write_some(
+                    true, boost::asio::const_buffer{},
+                    std::bind(
+                        &session<true>::on_write_raw,
+                        this->shared_from_this(),
+                        std::placeholders::_1,
+                        std::placeholders::_2));
+    }
+
+    // Open the deferred file of the current message on the file pool
+    void open_file(const base::file_range & deferred){
+
+        writing = true;
+
+        file_pool().submit([self = this->shared_from_this(), deferred]{
+            boost::system::error_code ec;
+            auto range = deferred.open_deferred(ec);
+
+            boost::asio::post(self->connection_.strand(), [self, ec, range]() mutable {
+                self->on_file_open(ec, std::move(range));
+            });
+        });
+    }
+
+    // Read the next frame of a file the stream writes on the file pool,
+    // into a copy of its range
+    void read_file(const base::file_range & file, std::size_t size){
+
+        writing = true;
+
+        file_pool().submit([self = this->shared_from_this(), range = file, size]() mutable {
+            boost::system::error_code ec;
+            multi_buffer chunk;
+            range.read(chunk, size, ec);
+
+            boost::asio::post(self->connection_.strand(), [self, ec, chunk = std::move(chunk)]() mutable {
+                self->on_file_read(ec, std::move(chunk));
+            });
+        });
+    }
+
+    // Splice the next frame of the file_writer into its pipe on the file pool
+    void fill_file(){
+
+        file_pool().submit([self = this->shared_from_this()]{
+            boost::system::error_code ec;
+            self->file_writer_.fill(self->options_.fragment_size, ec);
+
+            boost::asio::post(self->connection_.strand(), [self, ec]{
+                self->on_file_filled(ec);
+            });
+        });
+    }
+
+    // The raw frame is out, let the reads on
+    void release_reads(){
+        read_batch_.release(connection_.strand());
+
+        if(readable)
+            do_read();
     }
 
-    void do_close(boost::beast::websocket::close_reason const & reason){
+    // Wait for the kernel to report sent zerocopy messages. The error queue
+    // is read after the wait is armed, so no report slips in between
+    void watch_zerocopy(){
 
-        if(!accepted)
+        if(zerocopy_watching_ || !zerocopy_.pending())
             return;
 
-        timer_p_->stream().expires_after(std::chrono::seconds(10));
-
-        connection_p_->async_close(reason,
-                                   std::bind(
-                                       &session<true>::on_close,
-                                       this->shared_from_this(),
-                                       std::placeholders::_1));
-    }
+        zerocopy_watching_ = true;
 
-    void launch_timer()
-    {
-        timer_p_->async_wait(
+        connection_.async_wait_raw(
+                    boost::asio::socket_base::wait_error,
                     std::bind(
-                        &session<true>::on_timer,
+                        &session<true>::on_zerocopy_report,
                         this->shared_from_this(),
                         std::placeholders::_1));
-    }
-
-    template<class F>
-    void launch_timer(F&& f){
 
-        on_timer_cb = std::forward<F>(f);
+        zerocopy_.reap();
+    }
 
-        timer_p_->async_wait(
-                    std::bind(
-                        &session<true>::on_timer,
-                        this->shared_from_this(),
-                        std::placeholders::_1));
+    void do_accept_buffered()
+    {
+        if(decorator_cb_){
+            connection_.async_accept_ex(handshake_buffer_.data(), decorator_cb_,
+                                           std::bind(
+                                               &session<true>::on_accept,
+                                               this->shared_from_this(),
+                                               std::placeholders::_1));
+        }else{
+            connection_.async_accept(handshake_buffer_.data(),
+                                        std::bind(
+                                            &session<true>::on_accept,
+                                            this->shared_from_this(),
+                                            std::placeholders::_1));
+        }
     }
 
-    void do_read(){
+    template<class Routes>
+    void on_read_upgrade(const std::shared_ptr<const Routes> & routes, const boost::system::error_code & ec,
+                         std::size_t bytes_transferred)
+    {
+        boost::ignore_unused(bytes_transferred);
 
-        if(!accepted || !readable)
+        // Happens when the timer closes the socket
+        if(ec == boost::asio::error::operation_aborted)
             return;
 
-        timer_p_->stream().expires_after(std::chrono::seconds(10));
+        if(ec)
+            return logging::fail(ec, "read upgrade");
 
-        readable = false;
+        auto const & req = upgrade_parser_->get();
 
-        connection_p_->async_read(
-                    input_buffer_,
-                        std::bind(
-                            &session<true>::on_read,
-                            this->shared_from_this(),
-                            std::placeholders::_1,
-                            std::placeholders::_2));
+        if(!boost::beast::websocket::is_upgrade(req))
+            return do_reject(boost::beast::http::status::bad_request);
+
+        auto const handler = routes->find(req.target());
+        if(handler == nullptr || !*handler)
+            return do_reject(boost::beast::http::status::not_found);
+
+        (*handler)(*this, req);
     }
 
-    void do_write(){
+    void on_reject(const boost::system::error_code & ec, std::size_t bytes_transferred)
+    {
+        boost::ignore_unused(bytes_transferred);
 
-        if(!accepted)
-            return;
+        if(ec && ec != boost::asio::error::operation_aborted)
+            logging::fail(ec, "reject");
 
-        connection_p_->async_write(
-            output_buffer_,
-                std::bind(
-                    &session<true>::on_write,
-                    this->shared_from_this(),
-                    std::placeholders::_1,
-                    std::placeholders::_2));
+        boost::system::error_code ec_;
+        connection_.stream().next_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec_);
+        connection_.stream().next_layer().close(ec_);
     }
 
-protected:
-
     void on_accept(const boost::system::error_code & ec)
     {
+        // The stream has copied what it needs
+        handshake_buffer_ = {};
+        upgrade_parser_.reset();
+
         // Happens when the timer closes the socket
         if(ec == boost::asio::error::operation_aborted)
             return;
 
         if(ec)
-            return http::base::fail(ec, "accept");
+            return logging::fail(ec, "accept");
 
         accepted = true;
+        last_activity_ = std::chrono::steady_clock::now();
+        // no io buffers yet, the first message is waited for with the wake byte
+        hibernated = options_.hibernate_after > std::chrono::steady_clock::duration::zero();
 
         if(on_accept_cb_)
             on_accept_cb_(*this, output_buffer_);
 
         if(output_buffer_.size() > 0)
             do_write();
-        else if(readable)
+
+        if(readable)
             do_read();
 
     }
@@ -259,9 +1295,12 @@ protected:
         if(ec == boost::asio::error::operation_aborted)
             return;
 
+        writing = false;
+
         if(ec)
-            return http::base::fail(ec, "ping");
+            return logging::fail(ec, "ping");
 
+        write_next();
     }
 
     // Called after a pong is sent.
@@ -271,9 +1310,12 @@ protected:
         if(ec == boost::asio::error::operation_aborted)
             return;
 
+        writing = false;
+
         if(ec)
-            return http::base::fail(ec, "pong");
+            return logging::fail(ec, "pong");
 
+        write_next();
     }
 
     // Called after a close is sent.
@@ -283,8 +1325,11 @@ protected:
         if(ec == boost::asio::error::operation_aborted)
             return;
 
+        writing = false;
+        finished_ = true;
+
         if(ec)
-            return http::base::fail(ec, "close");
+            return logging::fail(ec, "close");
 
         // At this point the connection is gracefully closed
     }
@@ -292,34 +1337,267 @@ protected:
     void on_timer(boost::system::error_code ec)
     {
         if(ec && ec != boost::asio::error::operation_aborted)
-            return http::base::fail(ec, "timer");
+            return logging::fail(ec, "timer");
+
+        // Still waiting for the upgrade request (standalone listener).
+        // Close the socket on expiry, the timer is not re-armed
+        if(!accepted){
+            if(ec != boost::asio::error::operation_aborted
+                    && timer_.stream().expiry() <= std::chrono::steady_clock::now()){
+                boost::system::error_code ec_;
+                connection_.stream().next_layer().close(ec_);
+            }
+            return;
+        }
 
         // Verify that the timer really expired since the deadline may have moved.
-        if(timer_p_->stream().expiry() <= std::chrono::steady_clock::now())
+        if(timer_.stream().expiry() <= std::chrono::steady_clock::now())
         {
 
+            if(options_.slow_consumer == slow_consumer_policy::disconnect && lagging())
+                return disconnect_slow_consumer();
+
+            if(options_.hibernate_after > std::chrono::steady_clock::duration::zero()
+                    && std::chrono::steady_clock::now() - last_activity_ >= options_.hibernate_after)
+                hibernate();
+
             if(on_timer_cb)
             {
                 on_timer_cb(*this);
                 return;
             }
 
-            timer_p_->stream().expires_after(std::chrono::seconds(10));
-
-            connection_p_->async_close(boost::beast::websocket::close_code::normal,
-                                       std::bind(
-                                           &session<true>::on_close,
-                                           this->shared_from_this(),
-                                           std::placeholders::_1));
+            do_close(boost::beast::websocket::close_code::normal);
         }
 
         launch_timer();
     }
 
+    // Called when the file pool has opened a deferred file
+    void on_file_open(const boost::system::error_code & ec, base::file_range&& range)
+    {
+        writing = false;
+
+        // skipped, the next message goes on
+        if(ec){
+            logging::fail(ec, "send_file");
+            write_queue_.pop();
+        }
+        else
+            write_queue_.opened(std::move(range));
+
+        write_next();
+    }
+
+    // Called when the file pool has read the next frame of a file
+    void on_file_read(const boost::system::error_code & ec, multi_buffer&& chunk)
+    {
+        writing = false;
+
+        if(ec){
+            logging::fail(ec, "send_file");
+            return abort_connection(boost::beast::websocket::close_code::internal_error);
+        }
+
+        write_queue_.filled(std::move(chunk));
+        write_next();
+    }
+
+    // Called when the file pool has put the next frame of a file in its pipe
+    void on_file_filled(const boost::system::error_code & ec)
+    {
+        if(ec){
+            writing = false;
+            logging::fail(ec, "send_file");
+            return abort_connection(boost::beast::websocket::close_code::internal_error);
+        }
+
+        raw_next();
+    }
+
+    // Called when the empty frame before a raw frame is written: no write
+    // of the stream is on its way, hold the reads until the raw frame is out
+    void on_raw_ready(const boost::system::error_code & ec, std::size_t)
+    {
+        if(ec == boost::asio::error::operation_aborted)
+            return;
+
+        if(ec){
+            writing = false;
+            return logging::fail(ec, "write");
+        }
+
+        read_batch_.hold();
+        write_raw();
+    }
+
+    // Called when the socket has room for the rest of a raw frame
+    void on_raw_writable(const boost::system::error_code & ec)
+    {
+        if(ec){
+            release_reads();
+            writing = false;
+
+            if(ec != boost::asio::error::operation_aborted)
+                logging::fail(ec, "raw write");
+            return;
+        }
+
+        write_raw();
+    }
+
+    // Called when the stream has ended a zerocopy message or file
+    void on_write_raw(const boost::system::error_code & ec, std::size_t)
+    {
+        if(ec == boost::asio::error::operation_aborted)
+            return;
+
+        writing = false;
+
+        // raw messages are binary (raw_next), the session's own frame type
+        // is back for whatever the stream writes next
+        connection_.stream().text(text_frame);
+
+        if(ec)
+            return logging::fail(ec, "write");
+
+        write_next();
+
+        if(readable)
+            do_read();
+    }
+
+    // Called when the socket error queue has zerocopy reports
+    void on_zerocopy_report(const boost::system::error_code & ec)
+    {
+        zerocopy_watching_ = false;
+
+        // the socket is closed, what is left goes with the writer
+        if(ec)
+            return;
+
+        zerocopy_.reap();
+        watch_zerocopy();
+    }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    // The read of a released session has ended (see release_idle)
+    void finish_release(const boost::system::error_code & ec){
+        finished_ = true;
+
+        int fd = release_fd_;
+        release_fd_ = -1;
+
+        // the stream read on before the socket closed
+        if(ec != boost::asio::error::operation_aborted || !handoff::stream_quiet(connection_.stream())){
+            ::close(fd);
+            fd = -1;
+        }
+
+        auto const on_released = std::move(on_released_);
+        on_released_ = nullptr;
+        on_released(fd, release_state_);
+    }
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+
+    // Called once memory_budget is back under its limit
+    void on_budget()
+    {
+        budget_waiter_ = false;
+        on_budget_retry({});
+    }
+
+    // Called a while after the reads paused over the memory budget
+    void on_budget_retry(const boost::system::error_code & ec)
+    {
+        if(ec == boost::asio::error::operation_aborted || !budget_paused_)
+            return;
+
+        budget_paused_ = false;
+        readable = true;
+        do_read();
+    }
+
+    boost::asio::steady_timer & throttle_timer(){
+        if(!throttle_timer_)
+            throttle_timer_ = std::make_unique<boost::asio::steady_timer>(
+                        connection_.strand().get_inner_executor().context());
+        return *throttle_timer_;
+    }
+
+    // Called when the inbound budget has refilled
+    void on_throttle(const boost::system::error_code & ec)
+    {
+        if(ec == boost::asio::error::operation_aborted)
+            return;
+
+        if(ec)
+            return logging::fail(ec, "throttle");
+
+        readable = true;
+        do_read();
+    }
+
+    // Called with the first byte of a message
+    void on_wake(const boost::system::error_code & ec, std::size_t bytes_transferred)
+    {
+        waking = false;
+        reading_ = false;
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        if(release_fd_ >= 0)
+            return finish_release(ec);
+#endif
+
+        // the connection is over, drain() need not wait for it
+        if(ec)
+            finished_ = true;
+
+        // Happens when the timer closes the socket
+        if(ec == boost::asio::error::operation_aborted)
+            return;
+
+        // This indicates that the websocket_session was closed
+        if(ec == boost::beast::websocket::error::closed)
+            return;
+
+        if(ec)
+            return logging::fail(ec, "read");
+
+        input_buffer_.commit(boost::asio::buffer_copy(input_buffer_.prepare(bytes_transferred),
+                                                      boost::asio::buffer(wake_byte_, bytes_transferred)));
+
+        if(connection_.stream().is_message_done())
+            return on_read(ec, bytes_transferred);
+
+        // Read the rest of the message
+        reading_ = true;
+
+        connection_.async_read(
+                    input_buffer_,
+                    read_batch_,
+                        std::bind(
+                            &session<true>::on_read,
+                            this->shared_from_this(),
+                            std::placeholders::_1,
+                            std::placeholders::_2));
+    }
+
     void on_read(const boost::system::error_code & ec, std::size_t bytes_transferred)
     {
         boost::ignore_unused(bytes_transferred);
 
+        reading_ = false;
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        if(release_fd_ >= 0)
+            return finish_release(ec);
+#endif
+
+        // the connection is over, drain() need not wait for it
+        if(ec)
+            finished_ = true;
+
         // Happens when the timer closes the socket
         if(ec == boost::asio::error::operation_aborted)
             return;
@@ -329,52 +1607,223 @@ protected:
             return;
 
         if(ec)
-            return http::base::fail(ec, "read");
+            return logging::fail(ec, "read");
 
         readable = true;
 
-        if(on_message_cb_)
+        // a message after hibernate_after of silence leaves the session
+        // hibernated, the next one is waited for with the wake byte as well
+        auto const now = std::chrono::steady_clock::now();
+        if(options_.hibernate_after <= std::chrono::steady_clock::duration::zero()
+                || now - last_activity_ < options_.hibernate_after)
+            hibernated = false;
+        last_activity_ = now;
+
+        read_batch_.add();
+
+        message_bucket_.consume(1, last_activity_);
+        byte_bucket_.consume(static_cast<double>(input_buffer_.size()), last_activity_);
+
+        if(offloaded()){
+            handlers_.push_back({std::move(input_buffer_), connection_.stream().got_text()});
+            input_buffer_ = multi_buffer{};
+
+            if(!handler_running_)
+                run_handler();
+
+            if(readable)
+                read_on();
+            return;
+        }
+
+        if(on_message_cb_){
+            handled_input_ = &input_buffer_;
+            handled_text_ = connection_.stream().got_text();
             on_message_cb_(*this, input_buffer_, output_buffer_);
+            handled_input_ = nullptr;
+        }
 
         input_buffer_.consume(input_buffer_.size());
 
         if(auto_frame)
             //Is this a text frame? If are not, to set binary
-            connection_p_->stream().text(connection_p_->stream().got_text());
+            text_frame = connection_.stream().got_text();
 
         if(output_buffer_.size() > 0)
             do_write();
-        else if(readable)
-            do_read();
 
+        // The next message is read while the replies are written
+        if(readable)
+            read_on();
+
+    }
+
+    // Read the next message. One the stream already holds is handled right
+    // here, up to session_options::read_batch messages in a row
+    void read_on(){
+        auto const before = read_batch_.handled;
+
+        read_batch_.armed = read_batch_.messages < options_.read_batch;
+        do_read();
+        read_batch_.armed = false;
+
+        // not read in place, the batch is over
+        if(read_batch_.handled == before)
+            read_batch_.finish(options_.read_batch);
+    }
+
+
+    // A descriptor is checked and duplicated here, a path is opened on the
+    // file pool when its turn comes
+    static base::file_range prepare_file(int fd, std::uint64_t offset, std::uint64_t length,
+                                         boost::system::error_code & ec){
+        return base::file_range::open(fd, offset, length, ec);
+    }
+
+    static base::file_range prepare_file(const std::string & path, std::uint64_t offset, std::uint64_t length,
+                                         boost::system::error_code &){
+        return base::file_range::deferred(path, offset, length);
+    }
+
+    base::work_pool & file_pool() const{
+        return options_.file_pool != nullptr ? *options_.file_pool : base::file_pool();
     }
 
+    bool offloaded() const{
+        return options_.handler_pool != nullptr && on_message_cb_;
+    }
+
+    // Hand the oldest waiting message to the pool. Only the strand adds to
+    // handlers_, and only at the back, so the worker's element stays put
+    void run_handler(){
+        handler_running_ = true;
+
+        auto const item = &handlers_.front();
+
+        options_.handler_pool->submit([self = this->shared_from_this(), item]{
+            multi_buffer output;
+            self->handled_input_ = &item->input;
+            self->handled_text_ = item->text;
+            self->on_message_cb_(*self, item->input, output);
+            self->handled_input_ = nullptr;
+
+            boost::asio::post(self->connection_.strand(),
+                              [self, output = std::move(output)]() mutable {
+                self->on_handler_done(std::move(output));
+            });
+        });
+    }
+
+    // Called on the strand when the pool is done with a message
+    void on_handler_done(multi_buffer&& output){
+        auto const text = handlers_.front().text;
+        handlers_.pop_front();
+        handler_running_ = false;
+
+        if(output.size() > 0){
+            if(auto_frame)
+                text_frame = text;
+            send(std::move(output));
+        }
+
+        if(!handlers_.empty())
+            run_handler();
+
+        if(readable)
+            do_read();
+    }
 
+    // Called after a frame of the current message is sent
     void on_write(const boost::system::error_code & ec,
                   std::size_t bytes_transferred)
     {
-        boost::ignore_unused(bytes_transferred);
-
         // Happens when the timer closes the socket
         if(ec == boost::asio::error::operation_aborted)
             return;
 
+        writing = false;
+
         if(ec)
-            return http::base::fail(ec, "write");
+            return logging::fail(ec, "write");
+
+        last_activity_ = std::chrono::steady_clock::now();
+
+        write_queue_.consume(bytes_transferred);
 
-        output_buffer_.consume(output_buffer_.size());
+        if(write_queue_.current()->size() == 0)
+            write_queue_.pop();
+
+        write_next();
 
         // Do another read
         if(readable)
             do_read();
     }
 
-    http::base::timer::ptr timer_p_;
-    base::connection::ptr connection_p_;
+    // session, timer and connection share one allocation
+    http::base::timer timer_;
+    base::connection connection_;
+
+    // bytes read by the HTTP layer past the upgrade request
+    boost::beast::flat_buffer handshake_buffer_;
+    // upgrade request read by the standalone listener
+    std::unique_ptr<boost::beast::http::request_parser<boost::beast::http::empty_body>> upgrade_parser_;
 
     // io buffers
-    boost::beast::multi_buffer input_buffer_;
-    boost::beast::multi_buffer output_buffer_;
+    multi_buffer input_buffer_;
+    multi_buffer output_buffer_;
+
+    // outbound control frames and messages
+    base::outbound_queue<multi_buffer> write_queue_;
+
+    // large binary messages, destroyed before the connection
+    base::zerocopy_writer<multi_buffer> zerocopy_;
+    // a wait for zerocopy reports is armed
+    bool zerocopy_watching_ = false;
+    // files sent with sendfile
+    base::file_writer file_writer_;
+
+    // messages for session_options::handler_pool, the front one is there
+    struct handed_message{
+        multi_buffer input;
+        bool text;
+    };
+    std::deque<handed_message> handlers_;
+    bool handler_running_ = false;
+
+    // input of the on_message call in progress, on the thread running it
+    // (see take_message)
+    multi_buffer* handled_input_ = nullptr;
+    bool handled_text_ = false;
+
+    // messages read back to back
+    base::read_batch read_batch_;
+
+    std::chrono::steady_clock::time_point last_activity_;
+    char wake_byte_[1];
+
+    // inbound rate limits
+    base::token_bucket message_bucket_;
+    base::token_bucket byte_bucket_;
+    // created on first use, also retries reads paused over the memory budget
+    std::unique_ptr<boost::asio::steady_timer> throttle_timer_;
+    // reads paused over the memory budget, a memory_budget::when_under
+    // callback is registered
+    bool budget_paused_ = false;
+    bool budget_waiter_ = false;
+
+    // counts the connection against its remote address
+    base::handshake_gate::ticket ticket_;
+
+    // kept for the handoff to another process
+    std::string target_;
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    // released, waiting for the read to end (see release_idle)
+    int release_fd_ = -1;
+    std::string release_state_;
+    std::function<void(int, const std::string&)> on_released_;
+#endif
 
 }; // class session
 
@@ -387,8 +1836,15 @@ class session<false> : private boost::noncopyable,
     bool handshaked = false;
     // Auto-detection of incoming frame type
     bool auto_frame = true;
+    // Frame type of the messages send() queues: the one set, or the last
+    // one received
+    bool text_frame = true;
     // Repeated asynchronous reading is impossible!
     bool readable = true;
+    // Write operation in progress
+    bool writing = false;
+    // Read once the queued writes are done
+    bool read_after_write = false;
 
     const std::function<void(boost::beast::websocket::request_type&)> & decorator_cb_;
 
@@ -401,6 +1857,8 @@ class session<false> : private boost::noncopyable,
 
 public:
 
+    using buffer_type = boost::beast::multi_buffer;
+
     explicit session(base::connection::ptr & connection_p,
                      const std::function<void(boost::beast::websocket::request_type&)> & decorator_cb,
                      const std::function<void(session<false>&, const boost::beast::websocket::response_type&, boost::beast::multi_buffer&, bool&)> & on_handshake_cb,
@@ -475,12 +1933,12 @@ public:
 
     void setTextFrame(){
         auto_frame = false;
-        connection_p_->stream().text(true);
+        text_frame = true;
     }
 
     void setBinaryFrame(){
         auto_frame = false;
-        connection_p_->stream().binary(true);
+        text_frame = false;
     }
 
     void do_ping(boost::beast::websocket::ping_data const & payload){
@@ -539,21 +1997,57 @@ public:
         if(!handshaked)
             return;
 
-        connection_p_->async_write(output_buffer_,
+        read_after_write = read_after_write || next_read;
+
+        send(std::move(output_buffer_));
+    }
+
+    /// \brief Queue a message behind the ones already being written
+    /// Call on the connection strand.
+    void send(boost::beast::multi_buffer&& message){
+
+        if(!handshaked)
+            return;
+
+        write_queue_.push(std::move(message), text_frame);
+
+        if(!writing)
+            write_next();
+    }
+
+    void send(boost::beast::string_view message){
+        boost::beast::multi_buffer buffer;
+        buffer.commit(boost::asio::buffer_copy(buffer.prepare(message.size()),
+                                               boost::asio::buffer(message.data(), message.size())));
+        send(std::move(buffer));
+    }
+
+protected:
+
+    void write_next(){
+
+        auto const message = write_queue_.current();
+        if(message == nullptr){
+            writing = false;
+            return;
+        }
+
+        writing = true;
+
+        connection_p_->stream().text(message->text);
+
+        connection_p_->async_write(message->data,
                                    std::bind(
                                        &session<false>::on_write,
                                        this->shared_from_this(),
                                        std::placeholders::_1,
-                                       std::placeholders::_2,
-                                       next_read));
+                                       std::placeholders::_2));
     }
 
-protected:
-
     void on_handshake(const boost::system::error_code & ec)
     {
         if(ec)
-            return http::base::fail(ec, "handshake");
+            return logging::fail(ec, "handshake");
 
         handshaked = true;
 
@@ -586,7 +2080,7 @@ protected:
             return;
 
         if(ec)
-            return http::base::fail(ec, "ping");
+            return logging::fail(ec, "ping");
 
     }
 
@@ -598,29 +2092,35 @@ protected:
             return;
 
         if(ec)
-            return http::base::fail(ec, "pong");
+            return logging::fail(ec, "pong");
 
     }
 
     void on_close(const boost::system::error_code & ec)
     {
         if(ec)
-            return http::base::fail(ec, "close");
+            return logging::fail(ec, "close");
     }
 
     void on_write(const boost::system::error_code & ec,
-                  std::size_t bytes_transferred, bool next_read)
+                  std::size_t bytes_transferred)
     {
         boost::ignore_unused(bytes_transferred);
 
+        writing = false;
+
         if(ec)
-            return http::base::fail(ec, "write");
+            return logging::fail(ec, "write");
+
+        write_queue_.pop();
 
-        output_buffer_.consume(output_buffer_.size());
+        write_next();
 
         // Read a message into our buffer
-        if(next_read && readable)
+        if(read_after_write && readable){
+            read_after_write = false;
             do_read();
+        }
 
     }
 
@@ -630,7 +2130,7 @@ protected:
         boost::ignore_unused(bytes_transferred);
 
         if(ec)
-            return http::base::fail(ec, "read");
+            return logging::fail(ec, "read");
 
         readable = true;
 
@@ -643,7 +2143,7 @@ protected:
 
         if(auto_frame)
             //Is this a text frame? If are not, to set binary
-            connection_p_->stream().text(connection_p_->stream().got_text());
+            text_frame = connection_p_->stream().got_text();
 
         if(output_buffer_.size() > 0)
             do_write(next_read);
@@ -656,6 +2156,9 @@ protected:
     boost::beast::multi_buffer input_buffer_;
     boost::beast::multi_buffer output_buffer_;
 
+    // messages to write, the current one is being written
+    base::outbound_queue<boost::beast::multi_buffer> write_queue_;
+
 }; // class session
 
 
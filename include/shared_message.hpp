@@ -0,0 +1,72 @@
+#ifndef BEAST_WS_SHARED_MESSAGE_HPP
+#define BEAST_WS_SHARED_MESSAGE_HPP
+
+#include "pool.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace ws {
+
+/// \brief Message payload that any number of sessions can queue without
+/// copying (session::take_message, session::send)
+/// The payload does not change once made, copies share it. Its blocks go
+/// back to the pool when the last session has written it.
+template<class Buffer>
+class basic_shared_message{
+
+    struct body{
+        Buffer data;
+        bool text;
+
+        body(Buffer&& d, bool t)
+            : data{std::move(d)}, text{t}
+        {}
+    };
+
+    std::shared_ptr<const body> body_;
+
+public:
+
+    using buffer_type = Buffer;
+    using const_buffers_type = typename Buffer::const_buffers_type;
+
+    basic_shared_message() = default;
+
+    /// \brief Take over the storage of a buffer
+    /// \param Payload, empty afterwards
+    /// \param Text frame, otherwise binary
+    basic_shared_message(Buffer&& data, bool text)
+        : body_{std::allocate_shared<body>(base::pool_allocator<body>{}, std::move(data), text)}
+    {}
+
+    explicit operator bool() const noexcept{
+        return body_ != nullptr;
+    }
+
+    std::size_t size() const{
+        return body_ ? body_->data.size() : 0;
+    }
+
+    bool text() const{
+        return body_ && body_->text;
+    }
+
+    const_buffers_type data() const{
+        static const Buffer empty;
+        return body_ ? body_->data.data() : empty.data();
+    }
+
+    /// \brief Copies and queued messages sharing the payload
+    long use_count() const noexcept{
+        return body_.use_count();
+    }
+
+}; // basic_shared_message class
+
+using shared_message = basic_shared_message<multi_buffer>;
+
+} // namespace ws
+
+#endif // BEAST_WS_SHARED_MESSAGE_HPP
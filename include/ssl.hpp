@@ -7,6 +7,8 @@
 #include <list_cb.hpp>
 #include <router.hpp>
 
+#include "logging.hpp"
+
 namespace http{
 
 namespace ssl{
@@ -247,7 +249,7 @@ protected:
     void on_handshake(const boost::system::error_code & ec, std::size_t bytes_used)
     {
         if(ec)
-            return http::base::fail(ec, "handshake");
+            return ws::logging::fail(ec, "handshake");
 
         handshake = true;
 
@@ -260,7 +262,7 @@ protected:
     void on_shutdown(const boost::system::error_code & ec)
     {
         if(ec)
-            return http::base::fail(ec, "shutdown");
+            return ws::logging::fail(ec, "shutdown");
     }
 
     void on_read(const boost::system::error_code & ec, std::size_t bytes_transferred){
@@ -271,7 +273,7 @@ protected:
             return do_close();
 
         if(ec)
-            return http::base::fail(ec, "read");
+            return ws::logging::fail(ec, "read");
 
         process_request();
     }
@@ -281,7 +283,7 @@ protected:
         boost::ignore_unused(bytes_transferred);
 
         if(ec)
-            return http::base::fail(ec, "write");
+            return ws::logging::fail(ec, "write");
 
         if(close)
         {
@@ -433,7 +435,7 @@ private:
     void on_handshake(boost::system::error_code ec)
     {
         if(ec)
-            return http::base::fail(ec, "handshake");
+            return ws::logging::fail(ec, "handshake");
 
         handshake = true;
 
@@ -450,7 +452,7 @@ private:
             ec.assign(0, ec.category());
         }
         if(ec)
-            return http::base::fail(ec, "shutdown");
+            return ws::logging::fail(ec, "shutdown");
 
         // If we get here then the connection is closed gracefully
     }
@@ -460,7 +462,7 @@ private:
         boost::ignore_unused(bytes_transferred);
 
         if(ec)
-            return http::base::fail(ec, "read");
+            return ws::logging::fail(ec, "read");
 
         if(on_message_cb_)
             on_message_cb_(res_, *this);
@@ -473,7 +475,7 @@ private:
         boost::ignore_unused(bytes_transferred);
 
         if(ec)
-            return http::base::fail(ec, "write");
+            return ws::logging::fail(ec, "write");
 
         do_read();
     }
@@ -797,7 +799,7 @@ class client_impl : private http::client_impl<ResBody>{
                                                      [this](const boost::system::error_code & ec){
             if(ec){
                 connection_p_->stream().get_executor().context().stop();
-                return http::base::fail(ec, "connect");
+                return ws::logging::fail(ec, "connect");
             }
 
             session<false, ResBody>::on_connect(std::ref(connection_p_), std::cref(on_connect), std::cref(on_handshake), std::cref(on_message));
@@ -0,0 +1,186 @@
+#ifndef BEAST_WS_WORK_POOL_HPP
+#define BEAST_WS_WORK_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/core/noncopyable.hpp>
+
+namespace ws {
+
+namespace base {
+
+/// \brief Threads for application work, apart from the io threads
+/// Every worker has a deque of its own. A worker takes its newest task
+/// first; once it has none, it steals the oldest task of another worker,
+/// then sleeps. Tasks submitted by a worker go to its own deque, the
+/// others round robin. There is no order between tasks, a session keeps
+/// its messages in order by having at most one of them in the pool (see
+/// session_options::handler_pool).
+class work_pool : private boost::noncopyable{
+
+    struct worker{
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::vector<std::thread> threads_;
+
+    // tasks submitted and not yet taken
+    std::atomic<long> queued_{0};
+    std::atomic<std::size_t> next_{0};
+    std::atomic<bool> stop_{false};
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    // workers waiting on wake_, submit() only notifies if there are any
+    std::atomic<std::size_t> sleeping_{0};
+
+    std::once_flag started_;
+
+    // pool and index of the calling worker thread
+    static std::pair<work_pool*, std::size_t> & self(){
+        thread_local std::pair<work_pool*, std::size_t> instance{nullptr, 0};
+        return instance;
+    }
+
+    bool take(std::size_t index, std::function<void()> & task){
+        {
+            auto & own = *workers_[index];
+            std::lock_guard<std::mutex> lock{own.mutex};
+            if(!own.tasks.empty()){
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for(std::size_t i = 1; i < workers_.size(); ++i){
+            auto & other = *workers_[(index + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock{other.mutex};
+            if(!other.tasks.empty()){
+                task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void run(std::size_t index){
+        self() = {this, index};
+
+        std::function<void()> task;
+
+        for(;;){
+            if(take(index, task)){
+                queued_.fetch_sub(1, std::memory_order_relaxed);
+                task();
+                task = nullptr;
+                continue;
+            }
+
+            // counted before queued_ is looked at, submit() counts queued_
+            // before it looks at this
+            std::unique_lock<std::mutex> lock{sleep_mutex_};
+            sleeping_.fetch_add(1);
+            wake_.wait(lock, [this]{
+                return stop_.load() || queued_.load() > 0;
+            });
+            sleeping_.fetch_sub(1, std::memory_order_relaxed);
+
+            // what was submitted before stop() still runs
+            if(stop_ && queued_.load() <= 0)
+                return;
+        }
+    }
+
+public:
+
+    ~work_pool(){
+        stop();
+        join();
+    }
+
+    /// \brief Start the workers, once. Thread safe
+    /// A pool that is not started yet starts with one thread per core on
+    /// its first submit().
+    /// \param Number of threads
+    void start(std::size_t threads){
+        std::call_once(started_, [this, threads]{
+            auto const count = threads == 0 ? 1 : threads;
+
+            for(std::size_t i = 0; i < count; ++i)
+                workers_.push_back(std::make_unique<worker>());
+
+            for(std::size_t i = 0; i < count; ++i)
+                threads_.emplace_back([this, i]{ run(i); });
+        });
+    }
+
+    /// \brief Run a task on one of the workers. Thread safe
+    template<class F>
+    void submit(F&& f){
+        start(std::thread::hardware_concurrency());
+
+        auto const & caller = self();
+        auto const index = caller.first == this
+                ? caller.second
+                : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+
+        // counted first, a worker that finds nothing yet looks again
+        queued_.fetch_add(1);
+
+        {
+            auto & w = *workers_[index];
+            std::lock_guard<std::mutex> lock{w.mutex};
+            w.tasks.emplace_back(std::forward<F>(f));
+        }
+
+        // no worker sleeps, each looks at queued_ before it does
+        if(sleeping_.load() == 0)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock{sleep_mutex_};
+        }
+        wake_.notify_one();
+    }
+
+    /// \brief The workers return once the submitted tasks have run
+    void stop(){
+        {
+            std::lock_guard<std::mutex> lock{sleep_mutex_};
+            stop_ = true;
+        }
+        wake_.notify_all();
+    }
+
+    void join(){
+        for(auto & t : threads_)
+            if(t.joinable())
+                t.join();
+        threads_.clear();
+    }
+
+    std::size_t size() const{
+        return workers_.size();
+    }
+
+}; // work_pool class
+
+} // namespace base
+
+} // namespace ws
+
+#endif // BEAST_WS_WORK_POOL_HPP
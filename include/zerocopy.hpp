@@ -0,0 +1,372 @@
+#ifndef BEAST_WS_ZEROCOPY_HPP
+#define BEAST_WS_ZEROCOPY_HPP
+
+#include "raw_frame.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <mutex>
+
+#include <boost/asio/error.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/beast/core/buffers_prefix.hpp>
+#include <boost/beast/core/buffers_suffix.hpp>
+#include <boost/core/ignore_unused.hpp>
+#include <boost/core/noncopyable.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#endif
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define BEAST_WS_HAS_ZEROCOPY 1
+#endif
+
+namespace ws {
+
+/// \brief MSG_ZEROCOPY counters, summed over all sessions
+struct zerocopy_counters{
+    std::atomic<std::uint64_t> messages{0};
+    std::atomic<std::uint64_t> bytes{0};
+    // sends the kernel completed by copying after all (e.g. loopback)
+    std::atomic<std::uint64_t> copied{0};
+    // sends that were copied because the pinned page limit was reached
+    std::atomic<std::uint64_t> fallbacks{0};
+};
+
+inline zerocopy_counters & zerocopy_stats(){
+    static zerocopy_counters instance;
+    return instance;
+}
+
+namespace base {
+
+/// \brief Writes large binary messages of a server session with MSG_ZEROCOPY
+/// Server frames are not masked, so a frame is a small header followed by
+/// the message bytes as they are. The header is copied, the payload pages
+/// are pinned and sent from the message buffer, which is therefore kept
+/// until the kernel reports on the socket error queue that it is done
+/// with them (reap). The writer sends on a duplicate of the socket, taken
+/// with the first message, so the reports can still be read once the
+/// session has closed its socket. A session that ends before they are all
+/// in leaves its messages and the duplicate behind until they are.
+/// Frames are written next to the websocket stream (see raw_frame.hpp).
+/// Linux 4.14 or later, elsewhere enable() fails.
+template<class Buffer>
+class zerocopy_writer : private boost::noncopyable{
+
+public:
+
+    using status = frame_status;
+
+private:
+
+    // sends [first, end) of a written message
+    struct retired{
+        std::uint32_t first;
+        std::uint32_t end;
+        // sends not yet completed
+        std::uint32_t left;
+        Buffer data;
+    };
+
+    // what ended sessions left behind
+    struct orphan{
+        int fd;
+        std::deque<retired> messages;
+    };
+
+    class orphanage{
+
+        std::mutex mutex_;
+        std::list<orphan> orphans_;
+
+    public:
+
+        ~orphanage(){
+            for(auto const & o : orphans_)
+                ::close(o.fd);
+        }
+
+        void adopt(int fd, std::deque<retired>&& messages){
+            std::lock_guard<std::mutex> lock{mutex_};
+            orphans_.push_back({fd, std::move(messages)});
+        }
+
+        void collect(){
+            std::unique_lock<std::mutex> lock{mutex_, std::try_to_lock};
+            if(!lock.owns_lock())
+                return;
+
+            for(auto it = orphans_.begin(); it != orphans_.end();){
+                complete(it->fd, it->messages);
+                if(it->messages.empty()){
+                    ::close(it->fd);
+                    it = orphans_.erase(it);
+                }
+                else
+                    ++it;
+            }
+        }
+
+    };
+
+    static orphanage & orphans(){
+        static orphanage instance;
+        return instance;
+    }
+
+    boost::asio::ip::tcp::socket* socket_ = nullptr;
+    // duplicate of the socket
+    int fd_ = -1;
+
+    // message being written
+    bool active_ = false;
+    Buffer current_;
+    std::size_t offset_ = 0;
+    raw_frame::progress frame_;
+    std::uint32_t first_seq_ = 0;
+
+    // id the kernel gives the next zerocopy send of the socket
+    std::uint32_t seq_ = 0;
+    std::deque<retired> retired_;
+    std::size_t retired_bytes_ = 0;
+
+#if defined(BEAST_WS_HAS_ZEROCOPY)
+    // Release what the kernel has completed
+    static void complete(int fd, std::deque<retired> & messages){
+        for(;;){
+            union{
+                cmsghdr align;
+                char data[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+            } control;
+
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control.data;
+            msg.msg_controllen = sizeof(control.data);
+
+            if(::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+                break;
+
+            for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+                if(!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                     || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                    continue;
+
+                sock_extended_err err;
+                std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                if(err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+                    continue;
+
+                if(err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                    zerocopy_stats().copied.fetch_add(1, std::memory_order_relaxed);
+
+                // sends [ee_info, ee_data] completed, ranges arrive in any order
+                std::uint32_t const lo = err.ee_info;
+                std::uint32_t const hi = err.ee_data + 1;
+
+                for(auto & m : messages){
+                    auto const from = (std::max)(lo, m.first);
+                    auto const to = (std::min)(hi, m.end);
+                    if(from < to)
+                        m.left -= to - from;
+                }
+            }
+        }
+
+        messages.erase(std::remove_if(messages.begin(), messages.end(),
+                                      [](const retired & m){ return m.left == 0; }),
+                       messages.end());
+    }
+
+    // the payload of the frame, as far as the socket takes it
+    bool send_payload(boost::system::error_code & ec){
+        while(frame_.payload_left > 0){
+            iovec iov[64];
+            std::size_t count = 0;
+
+            boost::beast::buffers_suffix<typename Buffer::const_buffers_type> rest{current_.data()};
+            rest.consume(offset_);
+
+            for(auto const b : boost::beast::buffers_prefix(static_cast<std::size_t>(frame_.payload_left), rest)){
+                if(count == 64)
+                    break;
+                iov[count].iov_base = const_cast<void*>(b.data());
+                iov[count].iov_len = b.size();
+                ++count;
+            }
+
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+
+            int flags = MSG_NOSIGNAL | MSG_DONTWAIT | MSG_ZEROCOPY;
+            auto r = ::sendmsg(fd_, &msg, flags);
+
+            // over the locked memory limit for pinned pages, copy this one
+            if(r < 0 && errno == ENOBUFS){
+                zerocopy_stats().fallbacks.fetch_add(1, std::memory_order_relaxed);
+                flags &= ~MSG_ZEROCOPY;
+                r = ::sendmsg(fd_, &msg, flags);
+            }
+
+            if(r < 0){
+                if(errno == EINTR)
+                    continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                    ec = raw_frame::last_error();
+                return false;
+            }
+
+            // every zerocopy send that took bytes gets an id
+            if(flags & MSG_ZEROCOPY)
+                ++seq_;
+
+            offset_ += static_cast<std::size_t>(r);
+            frame_.payload_left -= static_cast<std::uint64_t>(r);
+            zerocopy_stats().bytes.fetch_add(static_cast<std::uint64_t>(r), std::memory_order_relaxed);
+        }
+        return true;
+    }
+#else
+    static void complete(int, std::deque<retired> &){}
+#endif
+
+    void retire(){
+        if(seq_ != first_seq_){
+            retired_bytes_ += current_.size();
+            retired_.push_back({first_seq_, seq_, seq_ - first_seq_, std::move(current_)});
+        }
+
+        current_ = Buffer{};
+        active_ = false;
+    }
+
+public:
+
+    ~zerocopy_writer(){
+        if(fd_ < 0)
+            return;
+
+        if(active_)
+            retire();
+
+        complete(fd_, retired_);
+
+        // the pages may still go out, keep them and the socket until they did
+        if(!retired_.empty())
+            orphans().adopt(fd_, std::move(retired_));
+        else
+            ::close(fd_);
+    }
+
+    /// \brief Turn SO_ZEROCOPY on for the socket of the session
+    bool enable(boost::asio::ip::tcp::socket & socket){
+#if defined(BEAST_WS_HAS_ZEROCOPY)
+        int const on = 1;
+        if(::setsockopt(socket.native_handle(), SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0)
+            socket_ = &socket;
+#else
+        boost::ignore_unused(socket);
+#endif
+        return enabled();
+    }
+
+    bool enabled() const{
+        return socket_ != nullptr;
+    }
+
+    /// \brief A message is being written
+    bool active() const{
+        return active_;
+    }
+
+    /// \brief Written messages wait for the kernel
+    bool pending() const{
+        return !retired_.empty();
+    }
+
+    /// \brief Unsent bytes of the current message
+    std::size_t remaining() const{
+        return active_ ? current_.size() - offset_ : 0;
+    }
+
+    /// \brief Bytes held: the current message and those waiting for the kernel
+    std::size_t held() const{
+        return current_.size() + retired_bytes_;
+    }
+
+    void start(Buffer&& message){
+#if defined(BEAST_WS_HAS_ZEROCOPY)
+        if(fd_ < 0)
+            fd_ = ::fcntl(socket_->native_handle(), F_DUPFD_CLOEXEC, 0);
+#endif
+
+        current_ = std::move(message);
+        offset_ = 0;
+        frame_ = {};
+        first_seq_ = seq_;
+        active_ = true;
+
+        zerocopy_stats().messages.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// \brief Write the next frame of the current message, or what is left
+    /// of the frame the socket took in part
+    /// \param Payload bytes per frame, zero for no limit
+    /// \param Set on failure
+    status write_frame(std::size_t fragment, boost::system::error_code & ec){
+#if defined(BEAST_WS_HAS_ZEROCOPY)
+        if(!frame_.active()){
+            auto const rest = current_.size() - offset_;
+            frame_.start(fragment > 0 ? (std::min)(rest, fragment) : rest);
+        }
+
+        if(!raw_frame::send_header(fd_, frame_, ec) || !send_payload(ec))
+            return ec ? status::failed : status::would_block;
+
+        if(offset_ < current_.size())
+            return status::frame_done;
+
+        retire();
+        return status::message_done;
+#else
+        boost::ignore_unused(fragment);
+        ec = boost::asio::error::operation_not_supported;
+        return status::failed;
+#endif
+    }
+
+    /// \brief Release the written messages the kernel is done with
+    void reap(){
+        if(fd_ < 0)
+            return;
+
+        complete(fd_, retired_);
+
+        retired_bytes_ = 0;
+        for(auto const & m : retired_)
+            retired_bytes_ += m.data.size();
+
+        orphans().collect();
+    }
+
+}; // zerocopy_writer class
+
+} // namespace base
+
+} // namespace ws
+
+#endif // BEAST_WS_ZEROCOPY_HPP